@@ -64,11 +64,8 @@ int docmd_swap(arg_struct *arg) {
 }
 
 int docmd_rdn(arg_struct *arg) {
-    if (sp > 0) {
-        vartype *temp = stack[sp];
-        memmove(stack + 1, stack, sp * sizeof(vartype *));
-        stack[0] = temp;
-    }
+    if (sp > 0)
+        rotate_stack_down(sp + 1);
     print_trace();
     return ERR_NONE;
 }
@@ -727,6 +724,7 @@ int docmd_clrg(arg_struct *arg) {
             rm->array->data[i] = 0;
         for (i = 0; i < sz; i++)
             rm->array->is_string[i] = 0;
+        rm->array->string_count = 0;
         return ERR_NONE;
     } else if (regs->type == TYPE_COMPLEXMATRIX) {
         vartype_complexmatrix *cm;
@@ -1749,11 +1749,8 @@ int docmd_newmat(arg_struct *arg) {
 }
 
 int docmd_rup(arg_struct *arg) {
-    if (sp > 0) {
-        vartype *temp = stack[0];
-        memmove(stack, stack + 1, sp * sizeof(vartype *));
-        stack[sp] = temp;
-    }
+    if (sp > 0)
+        rotate_stack_up(sp + 1);
     print_trace();
     return ERR_NONE;
 }
@@ -525,6 +525,7 @@ int docmd_delr(arg_struct *arg) {
                 array->is_string[i] = rm->array->is_string[i + columns];
                 array->data[i] = rm->array->data[i + columns];
             }
+            array->string_count = rm->array->string_count;
             array->refcount = 1;
             rm->array->refcount--;
             rm->array = array;
@@ -1127,6 +1128,7 @@ int docmd_getm(arg_struct *arg) {
                 }
                 dst->array->is_string[n2] = src->array->is_string[n1];
             }
+        dst->array->string_count = src->array->string_count;
         return binary_result((vartype *) dst);
     } else /* m->type == TYPE_COMPLEXMATRIX */ {
         vartype_complexmatrix *src, *dst;
@@ -165,6 +165,7 @@ int docmd_insr(arg_struct *arg) {
                 array->is_string[i] = rm->array->is_string[i - columns];
                 array->data[i] = rm->array->data[i - columns];
             }
+            array->string_count = rm->array->string_count;
             array->refcount = 1;
             rm->array->refcount--;
             rm->array = array;
@@ -364,6 +365,7 @@ int docmd_putm(arg_struct *arg) {
                 dst->array->data[n2] = src->array->data[n1];
                 src->array->data[n1] = tp;
             }
+        dst->array->string_count += src->array->string_count;
         free_vartype(v);
         return ERR_NONE;
     } else if (stack[sp]->type == TYPE_REALMATRIX) {
@@ -938,6 +940,7 @@ int docmd_trans(arg_struct *arg) {
                 } else
                     dst->array->data[n2] = src->array->data[n1];
             }
+        dst->array->string_count = src->array->string_count;
         unary_result((vartype *) dst);
         return ERR_NONE;
     } else {
@@ -1247,11 +1247,8 @@ int docmd_rdnn(arg_struct *arg) {
         return err;
     if (n > sp + 1)
         return ERR_STACK_DEPTH_ERROR;
-    if (n > 1) {
-        vartype *v = stack[sp];
-        memmove(stack + sp - n + 2, stack + sp - n + 1, (n - 1) * sizeof(vartype *));
-        stack[sp - n + 1] = v;
-    }
+    if (n > 1)
+        rotate_stack_down(n);
     print_trace();
     return ERR_NONE;
 }
@@ -1263,11 +1260,8 @@ int docmd_rupn(arg_struct *arg) {
         return err;
     if (n > sp + 1)
         return ERR_STACK_DEPTH_ERROR;
-    if (n > 1) {
-        vartype *v = stack[sp - n + 1];
-        memmove(stack + sp - n + 1, stack + sp - n + 2, (n - 1) * sizeof(vartype *));
-        stack[sp] = v;
-    }
+    if (n > 1)
+        rotate_stack_up(n);
     print_trace();
     return ERR_NONE;
 }
@@ -2007,6 +2001,8 @@ int docmd_unparse(arg_struct *arg) {
 
 int docmd_eval(arg_struct *arg) {
     vartype_equation *eq = (vartype_equation *) stack[sp];
+    if (evaluate_directly(prgms[eq->data.index()].eq_data))
+        return ERR_NONE;
     if (program_running()) {
         int err = push_rtn_addr(current_prgm, pc);
         if (err != ERR_NONE)
@@ -2054,6 +2050,8 @@ int docmd_evaln(arg_struct *arg) {
     if (v->type != TYPE_EQUATION)
         return ERR_INVALID_TYPE;
     vartype_equation *eq = (vartype_equation *) v;
+    if (evaluate_directly(prgms[eq->data.index()].eq_data))
+        return ERR_NONE;
     if (program_running()) {
         int err = push_rtn_addr(current_prgm, pc);
         if (err != ERR_NONE)
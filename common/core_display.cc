@@ -579,6 +579,7 @@ static char display[272];
 static bool is_dirty = false;
 static int dirty_top, dirty_left, dirty_bottom, dirty_right;
 
+static bool catalog_stale = false;
 static int catalogmenu_section[5];
 static int catalogmenu_rows[5];
 static int catalogmenu_row[5];
@@ -606,6 +607,7 @@ static char special_key[6] = { 0, 0, 0, 0, 0, 0 };
 /*******************************/
 
 static void mark_dirty(int top, int left, int bottom, int right);
+static void update_catalog_2();
 static void fill_rect(int x, int y, int width, int height, int color);
 static int get_cat_index();
 
@@ -684,6 +686,7 @@ void clear_display() {
 }
 
 void flush_display() {
+    flush_catalog();
     if (!is_dirty)
         return;
     shell_blitter(display, 17, dirty_left, dirty_top,
@@ -2142,6 +2145,8 @@ void redisplay() {
     int avail_rows = 2;
     int i;
 
+    flush_catalog();
+
     if (eqn_draw())
         return;
     
@@ -3004,6 +3009,28 @@ int get_cat_item(int menukey) {
 }
 
 void update_catalog() {
+    /* While a program is running, variable and program changes only mark
+     * the catalog as stale; it is brought up to date by flush_catalog(),
+     * when the display is flushed or redrawn, or when the program stops.
+     * That way, a loop doing STO or CLV doesn't redraw the catalog menu on
+     * every iteration.
+     */
+    if (program_running()) {
+        catalog_stale = true;
+        return;
+    }
+    catalog_stale = false;
+    update_catalog_2();
+}
+
+void flush_catalog() {
+    if (!catalog_stale)
+        return;
+    catalog_stale = false;
+    update_catalog_2();
+}
+
+static void update_catalog_2() {
     int *the_menu;
     if (mode_commandmenu != MENU_NONE)
         the_menu = &mode_commandmenu;
@@ -98,6 +98,7 @@ void set_cat_row(int row);
 int get_cat_row();
 int get_cat_item(int menukey);
 void update_catalog();
+void flush_catalog();
 
 void clear_custom_menu();
 void assign_custom_key(int keynum, const char *name, int length);
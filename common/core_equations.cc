@@ -1837,7 +1837,7 @@ static int keydown_list(int key, bool shift, int *repeat) {
              */
             equation_data *eqd = prgms[((vartype_equation *) v)->data.index()].eq_data;
             std::vector<std::string> params, locals;
-            eqd->ev->collectVariables(&params, &locals);
+            eqd->get_ev()->collectVariables(&params, &locals);
             if (params.size() == 0) {
                 show_error(ERR_NO_MENU_VARIABLES);
                 return 1;
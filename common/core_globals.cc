@@ -27,6 +27,7 @@
 #include "core_display.h"
 #include "core_equations.h"
 #include "core_helpers.h"
+#include "core_linalg2.h"
 #include "core_main.h"
 #include "core_math1.h"
 #include "core_parser.h"
@@ -573,7 +574,14 @@ const menu_spec menus[] = {
 #define LABELS_INCREMENT 10
 
 /* Registers */
+/* The stack is a window into stack_buffer: stack points to level 0, and
+ * stack_capacity counts the slots from there to the end of the buffer. The
+ * slots below stack are free; they let RDN and R^ rotate a big stack by
+ * moving the window, instead of moving every level. See rotate_stack_down()
+ * and rotate_stack_up().
+ */
 vartype **stack = NULL;
+vartype **stack_buffer = NULL;
 int sp = -1;
 int stack_capacity = 0;
 vartype *lastx = NULL;
@@ -599,6 +607,11 @@ prgm_struct *prgms = NULL;
 int labels_capacity = 0;
 int labels_count = 0;
 label_struct *labels = NULL;
+static bool label_hash_valid = false;
+static int label_hash_size = 0;
+static int *label_hash_buckets = NULL;
+static int label_hash_next_capacity = 0;
+static int *label_hash_next = NULL;
 
 pgm_index current_prgm;
 int4 pc;
@@ -820,6 +833,8 @@ static void **shared_data;
 static bool shared_data_grow();
 static int shared_data_search(void *data);
 static void update_label_table(pgm_index prgm, int4 pc, int inserted);
+static void insert_label(int prgm, int4 pc, const arg_struct *arg);
+static void remove_label(int prgm, int4 pc);
 static void invalidate_lclbls(pgm_index idx, bool force);
 static int pc_line_convert(int4 loc, int loc_is_pc);
 
@@ -1081,6 +1096,7 @@ bool unpersist_vartype(vartype **v) {
                         break;
                 } else {
                     rm->array->is_string[i] = 1;
+                    rm->array->string_count++;
                     // 4-byte length followed by n bytes of text
                     int4 len;
                     if (!read_int4(&len))
@@ -1367,8 +1383,15 @@ static bool persist_globals() {
 
 bool loading_state = false;
 
+/* Startup timing, logged by load_state() */
+static uint4 load_programs_ms;
+static uint4 load_label_table_ms;
+static uint4 load_equations_ms;
+static int load_equations;
+
 static bool unpersist_globals() {
     int i;
+    uint4 start;
     shared_data_count = 0;
     shared_data_capacity = 0;
     shared_data = NULL;
@@ -1419,10 +1442,15 @@ static bool unpersist_globals() {
     int total_prgms;
     if (!read_int(&total_prgms))
         goto done;
+    start = shell_milliseconds();
     core_import_programs(total_prgms, NULL);
+    load_programs_ms = shell_milliseconds() - start;
     if (!read_int(&prgms_count))
         goto done;
+    start = shell_milliseconds();
     rebuild_label_table();
+    load_label_table_ms = shell_milliseconds() - start;
+    start = shell_milliseconds();
     prgms_and_eqns_count = prgms_count;
     while (--total_prgms >= prgms_count) {
         equation_data *eqd = new equation_data;
@@ -1448,8 +1476,7 @@ static bool unpersist_globals() {
             goto eqd_fail;
         if (new_eqn_idx(eqd->eqn_index) == -1)
             goto eqd_fail;
-        int errpos;
-        eqd->ev = Parser::parse(std::string(eqd->text, eqd->length), eqd->compatMode, &errpos);
+        // Not parsed until it is needed; see equation_data::get_ev()
         if (ver >= 2) {
             int mapsize;
             if (!read_int(&mapsize))
@@ -1468,18 +1495,15 @@ static bool unpersist_globals() {
         prgms[prgms_count + eqd->eqn_index] = prgms[total_prgms];
         prgms[total_prgms].eq_data = NULL;
         prgms[prgms_count + eqd->eqn_index].eq_data = eqd;
+        load_equations++;
     }
+    load_equations_ms = shell_milliseconds() - start;
 
     if (!read_int(&sp)) {
         sp = -1;
         goto done;
     }
-    stack_capacity = sp + 1;
-    if (stack_capacity < 4)
-        stack_capacity = 4;
-    stack = (vartype **) malloc(stack_capacity * sizeof(vartype *));
-    if (stack == NULL) {
-        stack_capacity = 0;
+    if (!resize_stack(sp < 3 ? 4 : sp + 1)) {
         sp = -1;
         goto done;
     }
@@ -1487,10 +1511,8 @@ static bool unpersist_globals() {
         if (!unpersist_vartype(&stack[i]) || stack[i] == NULL) {
             for (int j = 0; j < i; j++)
                 free_vartype(stack[j]);
-            free(stack);
-            stack = NULL;
+            free_stack();
             sp = -1;
-            stack_capacity = 0;
             goto done;
         }
     }
@@ -1520,6 +1542,7 @@ static bool unpersist_globals() {
         free(vars);
         vars = NULL;
     }
+    invalidate_var_index();
     if (!read_int(&vars_count)) {
         vars_count = 0;
         goto done;
@@ -1666,6 +1689,7 @@ int4 new_prgm_idx(int4 idx) {
 }
 
 int4 new_eqn_idx(int4 idx) {
+    eqn_generation++;
     if (idx == -1) {
         for (int i = prgms_count; i < prgms_and_eqns_count; i++)
             if (prgms[i].eq_data == NULL)
@@ -1686,6 +1710,7 @@ int4 new_eqn_idx(int4 idx) {
 }
 
 void clear_rtns_vars_and_prgms() {
+    flush_equation_cache();
     clear_all_rtns();
     current_prgm.clear();
     
@@ -1695,26 +1720,31 @@ void clear_rtns_vars_and_prgms() {
     vars = NULL;
     vars_count = 0;
     vars_capacity = 0;
+    invalidate_var_index();
     
     // At this point, no more equations exist, hence,
     // prmgs_count == prgms_and_eqns_count
     // Also, because the stack is clear, there won't be any
     // pending returns into equation code.
 
-    for (int i = 0; i < prgms_count; i++)
+    for (int i = 0; i < prgms_count; i++) {
         if (prgms[i].text != NULL)
             free(prgms[i].text);
+        invalidate_decoded(prgms + i);
+    }
     free(prgms);
     prgms = NULL;
     prgms_count = 0;
     prgms_and_eqns_count = 0;
     prgms_capacity = 0;
+    eqn_generation++;
 
     if (labels != NULL)
         free(labels);
     labels = NULL;
     labels_capacity = 0;
     labels_count = 0;
+    label_hash_valid = false;
 }
 
 int clear_prgm(const arg_struct *arg) {
@@ -1730,12 +1760,8 @@ int clear_prgm(const arg_struct *arg) {
             prgm = current_prgm;
         } else {
             int i;
-            for (i = labels_count - 1; i >= 0; i--)
-                if (string_equals(arg->val.text, arg->length,
-                                 labels[i].name, labels[i].length))
-                    goto found;
-            return ERR_LABEL_NOT_FOUND;
-            found:
+            if (!find_global_label_index(arg, &i))
+                return ERR_LABEL_NOT_FOUND;
             prgm.set_prgm(labels[i].prgm);
         }
     }
@@ -1752,6 +1778,7 @@ int clear_prgm_by_index(pgm_index prgm) {
     else if (current_prgm.is_prgm() && current_prgm.index() > prgm.index())
         current_prgm.set_prgm(current_prgm.prgm() - 1);
     free(prgms[prgm.index()].text);
+    invalidate_decoded(prgms + prgm.index());
     for (i = prgm.index(); i < prgms_and_eqns_count - 1; i++)
         prgms[i] = prgms[i + 1];
     prgms_count--;
@@ -1768,6 +1795,7 @@ int clear_prgm_by_index(pgm_index prgm) {
             i++;
     }
     labels_count = i;
+    label_hash_valid = false;
     if (prgms_count == 0 || prgm.index() == prgms_count) {
         pgm_index saved_prgm = current_prgm;
         int saved_pc = pc;
@@ -1824,6 +1852,7 @@ void clear_prgm_lines(int4 count) {
             i++;
     }
     labels_count = i;
+    label_hash_valid = false;
 
     invalidate_lclbls(current_prgm, false);
     clear_all_rtns();
@@ -1869,6 +1898,7 @@ void goto_dot_dot(bool force_new) {
     prgms[idx].size = 0;
     prgms[idx].lclbl_invalid = 1;
     prgms[idx].text = NULL;
+    prgms[idx].decoded = NULL;
     command = CMD_END;
     arg.type = ARGTYPE_NONE;
     store_command(0, command, &arg, NULL);
@@ -2067,15 +2097,174 @@ void get_next_command(int4 *pc, int *command, arg_struct *arg, int find_target,
     }
 }
 
+void invalidate_decoded(prgm_struct *prgm) {
+    decoded_prgm *dec = prgm->decoded;
+    if (dec == NULL)
+        return;
+    free(dec->line_index);
+    free(dec->line_pc);
+    free(dec->local_labels);
+    free(dec->lines);
+    free(dec);
+    prgm->decoded = NULL;
+}
+
+static int local_label_compare(const void *a, const void *b) {
+    const local_label *la = (const local_label *) a;
+    const local_label *lb = (const local_label *) b;
+    if (la->type != lb->type)
+        return la->type < lb->type ? -1 : 1;
+    if (la->val != lb->val)
+        return la->val < lb->val ? -1 : 1;
+    return la->pc < lb->pc ? -1 : la->pc > lb->pc ? 1 : 0;
+}
+
+static decoded_prgm *get_decoded_prgm() {
+    prgm_struct *prgm = prgms + current_prgm.index();
+    if (prgm->decoded != NULL)
+        return prgm->decoded;
+
+    int4 count = 0;
+    int4 nlabels = 0;
+    int4 pc2 = 0;
+    while (pc2 < prgm->size) {
+        if (prgm->text[pc2] == CMD_LBL && (prgm->text[pc2 + 1] & 112) == 0) {
+            int argtype = prgm->text[pc2 + 1] & 15;
+            if (argtype == ARGTYPE_STK)
+                nlabels += 2;
+            else if (argtype == ARGTYPE_NUM || argtype == ARGTYPE_LCLBL)
+                nlabels++;
+        }
+        pc2 += get_command_length(current_prgm, pc2);
+        count++;
+    }
+    decoded_prgm *dec = (decoded_prgm *) malloc(sizeof(decoded_prgm));
+    if (dec == NULL)
+        return NULL;
+    dec->line_index = (int4 *) malloc(prgm->size * sizeof(int4));
+    dec->line_pc = (int4 *) malloc(count * sizeof(int4));
+    dec->local_labels = (local_label *) malloc((nlabels + 1) * sizeof(local_label));
+    dec->lines = NULL;
+    if (dec->line_index == NULL || dec->line_pc == NULL || dec->local_labels == NULL) {
+        free(dec->line_index);
+        free(dec->line_pc);
+        free(dec->local_labels);
+        free(dec);
+        return NULL;
+    }
+    dec->lines_count = count;
+    dec->local_labels_count = nlabels;
+    for (pc2 = 0; pc2 < prgm->size; pc2++)
+        dec->line_index[pc2] = -1;
+    pc2 = 0;
+    nlabels = 0;
+    for (int4 i = 0; i < count; i++) {
+        dec->line_index[pc2] = i;
+        dec->line_pc[i] = pc2;
+        if (prgm->text[pc2] == CMD_LBL && (prgm->text[pc2 + 1] & 112) == 0) {
+            int argtype = prgm->text[pc2 + 1] & 15;
+            local_label *ll = dec->local_labels + nlabels;
+            if (argtype == ARGTYPE_NUM) {
+                int4 num = 0;
+                unsigned char c;
+                int4 pos = pc2 + 2;
+                do {
+                    c = prgm->text[pos++];
+                    num = (num << 7) | (c & 127);
+                } while ((c & 128) == 0);
+                ll->type = ARGTYPE_NUM;
+                ll->val = num;
+                ll->pc = pc2;
+                nlabels++;
+            } else if (argtype == ARGTYPE_LCLBL) {
+                ll->type = ARGTYPE_LCLBL;
+                ll->val = (unsigned char) prgm->text[pc2 + 2];
+                ll->pc = pc2;
+                nlabels++;
+            } else if (argtype == ARGTYPE_STK) {
+                // Synthetic LBL ST T etc.
+                // Reachable using GTO ST T as well as GTO 112
+                int4 num = 0;
+                switch (prgm->text[pc2 + 2]) {
+                    case 'T': num = 112; break;
+                    case 'Z': num = 113; break;
+                    case 'Y': num = 114; break;
+                    case 'X': num = 115; break;
+                    case 'L': num = 116; break;
+                }
+                ll->type = ARGTYPE_NUM;
+                ll->val = num;
+                ll->pc = pc2;
+                ll++;
+                ll->type = ARGTYPE_STK;
+                ll->val = 0;
+                ll->pc = pc2;
+                nlabels += 2;
+            }
+        }
+        pc2 += get_command_length(current_prgm, pc2);
+    }
+    qsort(dec->local_labels, nlabels, sizeof(local_label), local_label_compare);
+    prgm->decoded = dec;
+    return dec;
+}
+
+static bool decode_prgm_lines(decoded_prgm *dec) {
+    decoded_line *lines = (decoded_line *) malloc(dec->lines_count * sizeof(decoded_line));
+    if (lines == NULL)
+        return false;
+    for (int4 i = 0; i < dec->lines_count; i++) {
+        decoded_line *line = lines + i;
+        int4 pc2 = dec->line_pc[i];
+        get_next_command(&pc2, &line->cmd, &line->arg, 0, NULL);
+        line->next_pc = pc2;
+        /* Branch targets are resolved the first time the line executes,
+         * the same way get_next_command() does it, since the outcome of
+         * find_local_label() depends on where the search starts.
+         */
+        line->has_target = (line->cmd == CMD_GTO || line->cmd == CMD_XEQ)
+                && (line->arg.type == ARGTYPE_NUM
+                    || line->arg.type == ARGTYPE_LCLBL
+                    || line->arg.type == ARGTYPE_STK)
+                || line->cmd == CMD_GTOL || line->cmd == CMD_XEQL;
+        line->arg.target = -1;
+    }
+    dec->lines = lines;
+    return true;
+}
+
+void get_next_decoded_command(int4 *pc, int *command, arg_struct *arg) {
+    decoded_prgm *dec = get_decoded_prgm();
+    if (dec == NULL || dec->lines == NULL && !decode_prgm_lines(dec)) {
+        get_next_command(pc, command, arg, 1, NULL);
+        return;
+    }
+    int4 i = dec->line_index[*pc];
+    if (i == -1) {
+        /* Should not happen, but just to be safe... */
+        get_next_command(pc, command, arg, 1, NULL);
+        return;
+    }
+    decoded_line *line = dec->lines + i;
+    if (line->has_target && line->arg.target == -1) {
+        get_next_command(pc, command, arg, 1, NULL);
+        line->arg.target = arg->target;
+        return;
+    }
+    *command = line->cmd;
+    *arg = line->arg;
+    *pc = line->next_pc;
+}
+
 void rebuild_label_table() {
-    /* TODO -- this is *not* efficient; inserting and deleting ENDs and
-     * global LBLs should not cause every single program to get rescanned!
-     * But, I don't feel like dealing with that at the moment, so just
-     * this ugly brute force approach for now.
+    /* This is only used when loading state or importing programs;
+     * inserting and deleting ENDs and global LBLs while editing is
+     * handled incrementally, by insert_label() and remove_label().
      */
     int prgm_index;
     int4 pc;
     labels_count = 0;
+    label_hash_valid = false;
     for (prgm_index = 0; prgm_index < prgms_count; prgm_index++) {
         prgm_struct *prgm = prgms + prgm_index;
         pc = 0;
@@ -2130,8 +2319,65 @@ static void update_label_table(pgm_index prgm, int4 pc, int inserted) {
     }
 }
 
+static int label_position(int prgm, int4 pc) {
+    /* Binary search for the first label at or after (prgm, pc) */
+    int lo = 0, hi = labels_count;
+    while (lo < hi) {
+        int mid = (lo + hi) / 2;
+        if (labels[mid].prgm < prgm
+                || labels[mid].prgm == prgm && labels[mid].pc < pc)
+            lo = mid + 1;
+        else
+            hi = mid;
+    }
+    return lo;
+}
+
+/* Makes sure labels[] has room for one more label. store_command() calls
+ * this before it changes anything, so that insert_label() can't fail.
+ */
+static bool reserve_label() {
+    if (labels_count < labels_capacity)
+        return true;
+    label_struct *newlabels = (label_struct *)
+                realloc(labels, (labels_capacity + 50) * sizeof(label_struct));
+    if (newlabels == NULL)
+        return false;
+    labels = newlabels;
+    labels_capacity += 50;
+    return true;
+}
+
+static void insert_label(int prgm, int4 pc, const arg_struct *arg) {
+    int pos = label_position(prgm, pc);
+    memmove(labels + pos + 1, labels + pos,
+            (labels_count - pos) * sizeof(label_struct));
+    labels_count++;
+    label_struct *newlabel = labels + pos;
+    if (arg == NULL)
+        newlabel->length = 0;
+    else {
+        newlabel->length = arg->length;
+        memcpy(newlabel->name, arg->val.text, arg->length);
+    }
+    newlabel->prgm = prgm;
+    newlabel->pc = pc;
+    label_hash_valid = false;
+}
+
+static void remove_label(int prgm, int4 pc) {
+    int pos = label_position(prgm, pc);
+    if (pos == labels_count || labels[pos].prgm != prgm || labels[pos].pc != pc)
+        return;
+    labels_count--;
+    memmove(labels + pos, labels + pos + 1,
+            (labels_count - pos) * sizeof(label_struct));
+    label_hash_valid = false;
+}
+
 static void invalidate_lclbls(pgm_index idx, bool force) {
     prgm_struct *prgm = prgms + idx.index();
+    invalidate_decoded(prgm);
     if (force || !prgm->lclbl_invalid) {
         int4 pc2 = 0;
         while (pc2 < prgm->size) {
@@ -2175,6 +2421,13 @@ void delete_command(int4 pc) {
             return;
         nextprgm = prgm + 1;
         prgm->size -= 2;
+        int4 p = current_prgm.index();
+        remove_label(p, prgm->size);
+        for (int i = label_position(p + 1, 0); i < labels_count; i++) {
+            if (labels[i].prgm == p + 1)
+                labels[i].pc += prgm->size;
+            labels[i].prgm--;
+        }
         newsize = prgm->size + nextprgm->size;
         if (newsize > prgm->capacity) {
             int4 newcapacity = (newsize + 511) & ~511;
@@ -2189,12 +2442,12 @@ void delete_command(int4 pc) {
         for (pos = 0; pos < nextprgm->size; pos++)
             prgm->text[prgm->size++] = nextprgm->text[pos];
         free(nextprgm->text);
+        invalidate_decoded(nextprgm);
         clear_all_rtns();
         for (pos = current_prgm.index() + 1; pos < prgms_and_eqns_count - 1; pos++)
             prgms[pos] = prgms[pos + 1];
         prgms_count--;
         prgms_and_eqns_count--;
-        rebuild_label_table();
         invalidate_lclbls(current_prgm, true);
         draw_varmenu();
         return;
@@ -2204,9 +2457,8 @@ void delete_command(int4 pc) {
         prgm->text[pos] = prgm->text[pos + length];
     prgm->size -= length;
     if (command == CMD_LBL && argtype == ARGTYPE_STR)
-        rebuild_label_table();
-    else
-        update_label_table(current_prgm, pc, -length);
+        remove_label(current_prgm.index(), pc);
+    update_label_table(current_prgm, pc, -length);
     invalidate_lclbls(current_prgm, false);
     clear_all_rtns();
     draw_varmenu();
@@ -2225,6 +2477,11 @@ bool store_command(int4 pc, int command, arg_struct *arg, const char *num_str) {
         return false;
     }
 
+    if ((command == CMD_END || command == CMD_LBL) && !reserve_label()) {
+        display_error(ERR_INSUFFICIENT_MEMORY, false);
+        return false;
+    }
+
     /* We should never be called with pc = -1, but just to be safe... */
     if (pc == -1)
         pc = 0;
@@ -2329,6 +2586,7 @@ bool store_command(int4 pc, int command, arg_struct *arg, const char *num_str) {
         new_prgm->size = prgm->size - pc;
         new_prgm->capacity = (new_prgm->size + 511) & ~511;
         new_prgm->text = (unsigned char *) malloc(new_prgm->capacity);
+        new_prgm->decoded = NULL;
         // TODO - handle memory allocation failure
         for (i = pc; i < prgm->size; i++)
             new_prgm->text[i - pc] = prgm->text[i];
@@ -2342,12 +2600,21 @@ bool store_command(int4 pc, int command, arg_struct *arg, const char *num_str) {
         prgm->size = pc;
         prgm->text[prgm->size++] = CMD_END;
         prgm->text[prgm->size++] = ARGTYPE_NONE;
+        invalidate_decoded(prgm);
         pgm_index before;
         before.set_prgm(current_prgm.prgm() - 1);
         if (flags.f.printer_exists && (flags.f.trace_print || flags.f.normal_print))
             print_program_line(before, pc);
 
-        rebuild_label_table();
+        if (before.is_prgm()) {
+            int4 p = before.index();
+            for (i = label_position(p, pc); i < labels_count; i++) {
+                if (labels[i].prgm == p)
+                    labels[i].pc -= pc;
+                labels[i].prgm++;
+            }
+            insert_label(p, pc, NULL);
+        }
         invalidate_lclbls(current_prgm, true);
         invalidate_lclbls(before, true);
         clear_all_rtns();
@@ -2451,14 +2718,17 @@ bool store_command(int4 pc, int command, arg_struct *arg, const char *num_str) {
         memcpy(prgm->text + pc, buf, bufptr);
     }
     prgm->size += bufptr;
+    invalidate_decoded(prgm);
     if (command != CMD_END && flags.f.printer_exists && (flags.f.trace_print || flags.f.normal_print))
         print_program_line(current_prgm, pc);
     
-    if (command == CMD_END ||
-            (command == CMD_LBL && arg->type == ARGTYPE_STR))
-        rebuild_label_table();
-    else
-        update_label_table(current_prgm, pc, bufptr);
+    update_label_table(current_prgm, pc, bufptr);
+    if (current_prgm.is_prgm()) {
+        if (command == CMD_END)
+            insert_label(current_prgm.index(), pc, NULL);
+        else if (command == CMD_LBL && arg->type == ARGTYPE_STR)
+            insert_label(current_prgm.index(), pc, arg);
+    }
 
     if (!loading_state) {
         invalidate_lclbls(current_prgm, false);
@@ -2601,18 +2871,83 @@ static int pc_line_convert(int4 loc, int loc_is_pc) {
 int4 pc2line(int4 pc) {
     if (pc == -1)
         return 0;
-    else
-        return pc_line_convert(pc, 1);
+    decoded_prgm *dec = get_decoded_prgm();
+    if (dec != NULL) {
+        if (pc >= prgms[current_prgm.index()].size)
+            return dec->lines_count;
+        int4 i = dec->line_index[pc];
+        if (i != -1)
+            return i + 1;
+    }
+    return pc_line_convert(pc, 1);
 }
 
 int4 line2pc(int4 line) {
     if (line == 0)
         return -1;
+    decoded_prgm *dec = get_decoded_prgm();
+    if (dec != NULL)
+        return dec->line_pc[line > dec->lines_count ? dec->lines_count - 1 : line - 1];
+    return pc_line_convert(line, 0);
+}
+
+static int4 find_local_label_2(const arg_struct *arg);
+
+static int4 local_label_search(decoded_prgm *dec, const local_label *key) {
+    /* Binary search for the first label matching the key's type and
+     * value, at or after the key's pc
+     */
+    local_label *ll = dec->local_labels;
+    int4 lo = 0, hi = dec->local_labels_count;
+    while (lo < hi) {
+        int4 mid = (lo + hi) / 2;
+        if (local_label_compare(ll + mid, key) < 0)
+            lo = mid + 1;
+        else
+            hi = mid;
+    }
+    if (lo < dec->local_labels_count && ll[lo].type == key->type && ll[lo].val == key->val)
+        return ll[lo].pc;
     else
-        return pc_line_convert(line, 0);
+        return -2;
 }
 
 int4 find_local_label(const arg_struct *arg) {
+    decoded_prgm *dec = get_decoded_prgm();
+    if (dec == NULL)
+        return find_local_label_2(arg);
+    local_label key;
+    key.type = arg->type;
+    switch (arg->type) {
+        case ARGTYPE_NUM:
+            key.val = arg->val.num;
+            break;
+        case ARGTYPE_LCLBL:
+            key.val = (unsigned char) arg->val.lclbl;
+            break;
+        case ARGTYPE_STK:
+            // GTO ST T etc. goes to any synthetic LBL ST
+            if (arg->val.stk == 0)
+                return -2;
+            key.val = 0;
+            break;
+        default:
+            return -2;
+    }
+    /* The search starts at the current pc, and wraps around to the
+     * beginning of the program, so we're looking for the first match at
+     * or after pc, or, failing that, the first match overall.
+     */
+    key.pc = pc == -1 ? 0 : pc;
+    int4 target = local_label_search(dec, &key);
+    if (target == -2 && key.pc != 0) {
+        key.pc = 0;
+        target = local_label_search(dec, &key);
+    }
+    return target;
+}
+
+static int4 find_local_label_2(const arg_struct *arg) {
     int4 orig_pc = pc;
     int4 search_pc;
     int wrapped = 0;
@@ -2677,11 +3012,71 @@ int4 find_local_label(const arg_struct *arg) {
     return -2;
 }
 
+static int4 label_hash(const char *name, int namelen) {
+    return string_hash(name, namelen) & (label_hash_size - 1);
+}
+
+/* The label hash index maps global label names to their indexes in
+ * labels[]. It is rebuilt from labels[] on demand, after the label table
+ * has changed, so that batches of edits only pay for it once.
+ * Each bucket is a chain of label indexes, linked through label_hash_next,
+ * in descending order, so that the first match in a chain is the last
+ * label with that name, the same one a backward search of labels[] finds.
+ * If there isn't enough memory for the index, it is dropped, and lookups
+ * fall back on that backward search until a rebuild succeeds.
+ */
+static void drop_label_hash() {
+    free(label_hash_buckets);
+    label_hash_buckets = NULL;
+    label_hash_size = 0;
+    free(label_hash_next);
+    label_hash_next = NULL;
+    label_hash_next_capacity = 0;
+    label_hash_valid = false;
+}
+
+static bool rebuild_label_hash() {
+    int size = 16;
+    while (size < labels_count * 2)
+        size <<= 1;
+    if (size != label_hash_size) {
+        free(label_hash_buckets);
+        label_hash_buckets = (int *) malloc(size * sizeof(int));
+        if (label_hash_buckets == NULL) {
+            drop_label_hash();
+            return false;
+        }
+        label_hash_size = size;
+    }
+    if (labels_count > label_hash_next_capacity) {
+        free(label_hash_next);
+        label_hash_next_capacity = labels_capacity;
+        label_hash_next = (int *) malloc(label_hash_next_capacity * sizeof(int));
+        if (label_hash_next == NULL) {
+            drop_label_hash();
+            return false;
+        }
+    }
+    for (int i = 0; i < size; i++)
+        label_hash_buckets[i] = -1;
+    for (int i = 0; i < labels_count; i++) {
+        if (labels[i].length == 0)
+            continue;
+        int4 h = label_hash(labels[i].name, labels[i].length);
+        label_hash_next[i] = label_hash_buckets[h];
+        label_hash_buckets[h] = i;
+    }
+    label_hash_valid = true;
+    return true;
+}
+
 static int find_global_label_2(const arg_struct *arg, pgm_index *prgm, int4 *pc, int *idx) {
     int i;
     const char *name = arg->val.text;
     int namelen = arg->length;
-    for (i = labels_count - 1; i >= 0; i--) {
+    bool hashed = label_hash_valid || rebuild_label_hash();
+    for (i = hashed ? label_hash_buckets[label_hash(name, namelen)] : labels_count - 1;
+            i != -1; i = hashed ? label_hash_next[i] : i - 1) {
         int j;
         char *labelname;
         if (labels[i].length != namelen)
@@ -2710,6 +3105,44 @@ int find_global_label_index(const arg_struct *arg, int *idx) {
     return find_global_label_2(arg, NULL, NULL, idx);
 }
 
+int find_enclosing_label(int4 prgm, int4 pc) {
+    /* Returns the index in labels[] of the global label that the line at
+     * 'pc' in program 'prgm' (a unified index) falls under, that is, the last
+     * global label at or before that line, or -1 if there is none.
+     */
+    if (prgm < 0 || (prgm & 1) != 0)
+        // Special, or equation
+        return -1;
+    int index = prgm >> 1;
+    int i = label_position(index, pc + 1) - 1;
+    while (i >= 0 && labels[i].prgm == index && labels[i].length == 0)
+        i--;
+    if (i < 0 || labels[i].prgm != index)
+        return -1;
+    return i;
+}
+
+int get_rtn_addrs(int4 *prgms, int4 *pcs, int max) {
+    /* Fills prgms[] and pcs[] with the pending return addresses, innermost
+     * first, skipping the special ones used by SOLVE and INTEG, and returns
+     * how many there were, up to 'max'.
+     */
+    int n = 0;
+    for (int i = rtn_sp - 1; i >= 0 && n < max; i--) {
+        if (i == 1 && rtn_level_0_has_matrix_entry)
+            break;
+        int4 prgm = rtn_stack[i].get_prgm();
+        if (prgm >= 0) {
+            prgms[n] = prgm;
+            pcs[n] = rtn_stack[i].pc;
+            n++;
+        }
+        if (rtn_stack[i].has_matrix())
+            i -= 2;
+    }
+    return n;
+}
+
 int push_rtn_addr(pgm_index prgm, int4 pc) {
     if (rtn_level == MAX_RTN_LEVEL)
         return ERR_RTN_STACK_FULL;
@@ -3101,13 +3534,8 @@ int pop_func_state(bool error) {
             int fd_levels = fd->size - 4;
             int st_levels = st->size - 1;
             int old_depth = fd_levels + st_levels;
-            if (stack_capacity < old_depth) {
-                vartype **new_stack = (vartype **) realloc(stack, old_depth * sizeof(vartype *));
-                if (new_stack == NULL)
-                    return ERR_INSUFFICIENT_MEMORY;
-                stack = new_stack;
-                stack_capacity = old_depth;
-            }
+            if (stack_capacity < old_depth && !resize_stack(old_depth))
+                return ERR_INSUFFICIENT_MEMORY;
             for (int i = 0; i <= sp; i++)
                 free_vartype(stack[i]);
             memcpy(stack, st->array->data + 1, st_levels * sizeof(vartype *));
@@ -3119,13 +3547,8 @@ int pop_func_state(bool error) {
         } else {
             int st_levels = st->size - 1;
             int needed_capacity = st_levels + out;
-            if (stack_capacity < needed_capacity) {
-                vartype **new_stack = (vartype **) realloc(stack, needed_capacity * sizeof(vartype *));
-                if (new_stack == NULL)
-                    return ERR_INSUFFICIENT_MEMORY;
-                stack = new_stack;
-                stack_capacity = needed_capacity;
-            }
+            if (stack_capacity < needed_capacity && !resize_stack(needed_capacity))
+                return ERR_INSUFFICIENT_MEMORY;
             for (int i = 0; i <= sp - out; i++)
                 free_vartype(stack[i]);
             memmove(stack + st_levels, stack + sp + 1 - out, out * sizeof(vartype *));
@@ -3231,11 +3654,9 @@ static void remove_locals() {
             matedit_mode = 0;
         }
         if ((vars[i].flags & VAR_HIDING) != 0) {
-            for (int j = i - 1; j >= 0; j--)
-                if ((vars[j].flags & VAR_HIDDEN) != 0 && string_equals(vars[i].name, vars[i].length, vars[j].name, vars[j].length)) {
-                    vars[j].flags &= ~VAR_HIDDEN;
-                    break;
-                }
+            int j = find_hidden_var(i);
+            if (j != -1)
+                vars[j].flags &= ~VAR_HIDDEN;
         }
         free_vartype(vars[i].value);
         vars[i].length = 100;
@@ -3250,7 +3671,11 @@ static void remove_locals() {
             vars[to++] = vars[from];
         from++;
     }
+    if (to != last)
+        // Globals were moved down, not just locals dropped off the end
+        invalidate_var_index();
     vars_count -= from - to;
+    truncate_var_index();
     update_catalog();
 }
 
@@ -3966,8 +4391,17 @@ bool load_state(int4 ver_p, bool *clear, bool *too_new) {
     var_refs = new std::vector<int>;
     stk_refs = new std::vector<int>;
     idx_refs = new std::vector<int>;
+    load_programs_ms = 0;
+    load_label_table_ms = 0;
+    load_equations_ms = 0;
+    load_equations = 0;
+    uint4 start = shell_milliseconds();
     bool ret = load_state2(clear, too_new);
     loading_state = false;
+    char buf[128];
+    snprintf(buf, sizeof(buf), "load_state: %u ms; programs: %u ms; label table: %u ms; %d equations: %u ms, parsing deferred",
+            shell_milliseconds() - start, load_programs_ms, load_label_table_ms, load_equations, load_equations_ms);
+    shell_log(buf);
     char fn[1024];
     sprintf(fn, "%s/plus42-memory-stats.txt", getenv("HOME"));
     FILE *f = fopen(fn, "r+");
@@ -4022,6 +4456,7 @@ bool load_state(int4 ver_p, bool *clear, bool *too_new) {
                         fprintf(f, "    mismatched refcount; deleting equation\n");
                         delete eqd;
                         prgms[idx].eq_data = NULL;
+                        eqn_generation++;
                     } else {
                         fprintf(f, "    mismatched refcount; correcting\n");
                         eqd->refcount = r;
@@ -4042,6 +4477,7 @@ bool load_state(int4 ver_p, bool *clear, bool *too_new) {
                     // delete orphaned equation
                     delete eqd;
                     prgms[idx].eq_data = NULL;
+                    eqn_generation++;
                 } else {
                     // fix refcount
                     eqd->refcount = r;
@@ -4057,6 +4493,9 @@ bool load_state(int4 ver_p, bool *clear, bool *too_new) {
 }
 
 void save_state() {
+    // Don't save equations that only the parse cache refers to
+    flush_equation_cache();
+
     if (!write_int4(PLUS42_MAGIC) || !write_int4(PLUS42_VERSION))
         return;
 
@@ -4167,11 +4606,10 @@ void hard_reset(int reason) {
     /* Clear stack */
     for (int i = 0; i <= sp; i++)
         free_vartype(stack[i]);
-    free(stack);
+    free_stack();
     free_vartype(lastx);
     sp = 3;
-    stack_capacity = 4;
-    stack = (vartype **) malloc(stack_capacity * sizeof(vartype *));
+    resize_stack(4);
     for (int i = 0; i <= sp; i++)
         stack[i] = new_real(0);
     lastx = new_real(0);
@@ -4313,6 +4751,7 @@ void hard_reset(int reason) {
     mode_menu_caps = false;
 
     reset_math();
+    clear_lu_cache();
     eqn_end();
 
     clear_display();
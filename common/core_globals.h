@@ -234,6 +234,7 @@ extern bool loading_state;
 #define REG_Y 2
 #define REG_X 3
 extern vartype **stack;
+extern vartype **stack_buffer;
 extern int sp;
 extern int stack_capacity;
 extern vartype *lastx;
@@ -347,12 +348,42 @@ extern int vars_count;
 extern var_struct *vars;
 
 /* Programs */
+struct decoded_line {
+    int cmd;
+    int4 next_pc;
+    bool has_target;
+    arg_struct arg;
+};
+struct local_label {
+    unsigned char type;
+    int4 val;
+    int4 pc;
+};
+/* Index of a program's text, built in one pass the first time it is
+ * needed, and discarded whenever the program text is modified.
+ * line_index[pc] is the index of the line that starts at pc, or -1 if pc
+ * is not at the start of a line; line_pc[i] is the pc of line index i.
+ * local_labels[] lists the numeric and local labels, sorted by type, value,
+ * and pc, for find_local_label().
+ * lines[] is the pre-decoded form of the program, used by the run loop so
+ * that running programs don't have to decode the byte code on every pass.
+ * It is only built once the program actually runs.
+ */
+struct decoded_prgm {
+    int4 lines_count;
+    int4 *line_index;
+    int4 *line_pc;
+    int4 local_labels_count;
+    local_label *local_labels;
+    decoded_line *lines;
+};
 struct prgm_struct {
     int4 capacity;
     int4 size;
     int lclbl_invalid;
     unsigned char *text;
     equation_data *eq_data;
+    decoded_prgm *decoded;
 };
 extern int prgms_capacity;
 extern int prgms_count;
@@ -528,6 +559,8 @@ int mvar_prgms_exist();
 int label_has_mvar(int lblindex);
 int get_command_length(pgm_index prgm, int4 pc);
 void get_next_command(int4 *pc, int *command, arg_struct *arg, int find_target, const char **num_str);
+void get_next_decoded_command(int4 *pc, int *command, arg_struct *arg);
+void invalidate_decoded(prgm_struct *prgm);
 void rebuild_label_table();
 void delete_command(int4 pc);
 bool store_command(int4 pc, int command, arg_struct *arg, const char *num_str);
@@ -539,6 +572,7 @@ int4 line2pc(int4 line);
 int4 find_local_label(const arg_struct *arg);
 int find_global_label(const arg_struct *arg, pgm_index *prgm, int4 *pc);
 int find_global_label_index(const arg_struct *arg, int *idx);
+int find_enclosing_label(int4 prgm, int4 pc);
 int push_rtn_addr(pgm_index prgm, int4 pc);
 int push_indexed_matrix();
 int push_func_state(int n);
@@ -556,6 +590,7 @@ void pop_rtn_addr(pgm_index *prgm, int4 *pc, bool *stop);
 void pop_indexed_matrix(const char *name, int namelen);
 void clear_all_rtns();
 int get_rtn_level();
+int get_rtn_addrs(int4 *prgms, int4 *pcs, int max);
 bool solve_active();
 bool integ_active();
 bool unwind_stack_until_solve();
@@ -363,12 +363,17 @@ bool ensure_stack_capacity(int n) {
         return true;
     if (stack_capacity > sp + n)
         return true;
-    int new_capacity = stack_capacity + n + 16;
-    vartype **new_stack = (vartype **) realloc(stack, new_capacity * sizeof(vartype *));
-    if (new_stack == NULL)
+    return resize_stack(stack_capacity + n + 16);
+}
+
+bool resize_stack(int capacity) {
+    int headroom = (int) (stack - stack_buffer);
+    vartype **new_buffer = (vartype **) realloc(stack_buffer, (headroom + capacity) * sizeof(vartype *));
+    if (new_buffer == NULL)
         return false;
-    stack = new_stack;
-    stack_capacity = new_capacity;
+    stack_buffer = new_buffer;
+    stack = new_buffer + headroom;
+    stack_capacity = capacity;
     return true;
 }
 
@@ -376,11 +381,76 @@ void shrink_stack() {
     int new_capacity = sp + 1;
     if (new_capacity < 4)
         new_capacity = 4;
-    vartype **new_stack = (vartype **) realloc(stack, new_capacity * sizeof(vartype *));
-    if (new_stack != NULL) {
-        stack = new_stack;
-        stack_capacity = new_capacity;
+    if (stack != stack_buffer) {
+        memmove(stack_buffer, stack, (sp + 1) * sizeof(vartype *));
+        stack_capacity += (int) (stack - stack_buffer);
+        stack = stack_buffer;
     }
+    resize_stack(new_capacity);
+}
+
+void free_stack() {
+    free(stack_buffer);
+    stack_buffer = NULL;
+    stack = NULL;
+    stack_capacity = 0;
+}
+
+/* Moves the stack to a new buffer, with the given number of free slots
+ * below level 0, and the given capacity from level 0 up.
+ */
+static bool move_stack(int headroom, int capacity) {
+    vartype **new_buffer = (vartype **) malloc((headroom + capacity) * sizeof(vartype *));
+    if (new_buffer == NULL)
+        return false;
+    memcpy(new_buffer + headroom, stack, (sp + 1) * sizeof(vartype *));
+    free(stack_buffer);
+    stack_buffer = new_buffer;
+    stack = new_buffer + headroom;
+    stack_capacity = capacity;
+    return true;
+}
+
+/* Rotates the top n levels of the stack down: X goes to level n, and the
+ * levels in between move up one. When n is more than half the big stack, it
+ * is cheaper to rotate the whole stack, by moving the window one slot down,
+ * and then to rotate the levels below the top n back up. When the window
+ * hits the start of the buffer, it is moved to a new buffer with as many
+ * free slots as there are levels, so that the copying averages out to O(1)
+ * per rotation.
+ */
+void rotate_stack_down(int n) {
+    int m = sp + 1 - n;
+    vartype *x = stack[sp];
+    if (flags.f.big_stack && m < n - 1
+            && (stack > stack_buffer || move_stack(sp + 1, stack_capacity))) {
+        stack--;
+        stack_capacity++;
+        memmove(stack, stack + 1, m * sizeof(vartype *));
+    } else {
+        memmove(stack + m + 1, stack + m, (n - 1) * sizeof(vartype *));
+    }
+    stack[m] = x;
+}
+
+/* Rotates the top n levels of the stack up: level n goes to X, and the
+ * levels in between move down one. See rotate_stack_down(). Moving the window
+ * up takes away a slot at the top, so it is only done while the capacity
+ * stays at 4 or more, which 4STK relies on.
+ */
+void rotate_stack_up(int n) {
+    int m = sp + 1 - n;
+    vartype *v = stack[m];
+    int min_capacity = sp + 1 < 4 ? 4 : sp + 1;
+    if (flags.f.big_stack && m < n - 1
+            && (stack_capacity > min_capacity || move_stack(0, stack_capacity + sp + 1))) {
+        stack++;
+        stack_capacity--;
+        memmove(stack, stack - 1, m * sizeof(vartype *));
+    } else {
+        memmove(stack + m, stack + m + 1, (n - 1) * sizeof(vartype *));
+    }
+    stack[sp] = v;
 }
 
 phloat rad_to_angle(phloat x) {
@@ -448,6 +518,13 @@ bool string_equals(const char *s1, int s1len, const char *s2, int s2len) {
     return true;
 }
 
+uint4 string_hash(const char *s, int slen) {
+    uint4 h = 2166136261u;
+    for (int i = 0; i < slen; i++)
+        h = (h ^ (unsigned char) s[i]) * 16777619u;
+    return h;
+}
+
 int string_pos(const char *ntext, int nlen, const vartype *hs, int startpos) {
     int pos = -1;
     if (hs->type == TYPE_REAL) {
@@ -1447,6 +1524,7 @@ int dimension_array_ref(vartype *matrix, int4 rows, int4 columns) {
                 new_array->is_string[i] = 0;
                 new_array->data[i] = 0;
             }
+            new_array->string_count = oldmatrix->array->string_count;
             new_array->refcount = 1;
             oldmatrix->array->refcount--;
             oldmatrix->array = new_array;
@@ -41,7 +41,11 @@ int binary_result(vartype *x);
 void binary_two_results(vartype *x, vartype *y);
 int ternary_result(vartype *x);
 bool ensure_stack_capacity(int n);
+bool resize_stack(int capacity);
 void shrink_stack();
+void free_stack();
+void rotate_stack_down(int n);
+void rotate_stack_up(int n);
 phloat rad_to_angle(phloat x);
 phloat rad_to_deg(phloat x);
 phloat deg_to_rad(phloat x);
@@ -50,6 +54,7 @@ void append_alpha_string(const char *buf, int buflen, int reverse);
 
 void string_copy(char *dst, int *dstlen, const char *src, int srclen);
 bool string_equals(const char *s1, int s1len, const char *s2, int s2len);
+uint4 string_hash(const char *s, int slen);
 int string_pos(const char *ntext, int nlen, const vartype *hs, int startpos);
 bool vartype_equals(const vartype *v1, const vartype *v2);
 int anum(const char *text, int len, phloat *res);
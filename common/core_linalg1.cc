@@ -22,6 +22,7 @@
 #include "core_linalg2.h"
 #include "core_main.h"
 #include "core_variables.h"
+#include "shell.h"
 
 
 /**********************************/
@@ -79,8 +80,8 @@ int linalg_div(const vartype *left, const vartype *right,
             linalg_div_completion = completion;
             linalg_div_left = left;
             linalg_div_result = res;
-            return lu_decomp_r((vartype_realmatrix *) lu, perm,
-                                                div_rr_completion1); 
+            return lu_decomp_r_cached(right, (vartype_realmatrix *) lu, perm,
+                                                div_rr_completion1);
         } else {
             vartype_realmatrix *num = (vartype_realmatrix *) left;
             vartype_complexmatrix *denom = (vartype_complexmatrix *) right;
@@ -108,8 +109,8 @@ int linalg_div(const vartype *left, const vartype *right,
             linalg_div_completion = completion;
             linalg_div_left = left;
             linalg_div_result = res;
-            return lu_decomp_c((vartype_complexmatrix *) lu, perm,
-                                                div_rc_completion1);
+            return lu_decomp_c_cached(right, (vartype_complexmatrix *) lu,
+                                                perm, div_rc_completion1);
         }
     } else {
         if (right->type == TYPE_REALMATRIX) {
@@ -139,7 +140,7 @@ int linalg_div(const vartype *left, const vartype *right,
             linalg_div_completion = completion;
             linalg_div_left = left;
             linalg_div_result = res;
-            return lu_decomp_r((vartype_realmatrix *) lu, perm,
+            return lu_decomp_r_cached(right, (vartype_realmatrix *) lu, perm,
                                                     div_cr_completion1);
         } else {
             vartype_complexmatrix *num = (vartype_complexmatrix *) left;
@@ -168,8 +169,8 @@ int linalg_div(const vartype *left, const vartype *right,
             linalg_div_completion = completion;
             linalg_div_left = left;
             linalg_div_result = res;
-            return lu_decomp_c((vartype_complexmatrix *) lu, perm,
-                                                    div_cc_completion1);
+            return lu_decomp_c_cached(right, (vartype_complexmatrix *) lu,
+                                                    perm, div_cc_completion1);
         }
     }
 }
@@ -275,6 +276,409 @@ static int div_cc_completion2(int error, vartype_complexmatrix *a, int4 *perm,
 /***** Matrix-matrix multiplication *****/
 /****************************************/
 
+/* Blocked matrix multiplication
+ * The product is computed in blocks of core_settings.matrix_block_size rows
+ * and columns. Each block of the right-hand matrix is copied, transposed, into
+ * a cache, so the inner loop runs down two contiguous vectors, and so the block
+ * stays in the CPU's L1 cache while every row of the left-hand matrix is
+ * multiplied by it. The terms of each sum are added in the same order as by
+ * the basic i,j,k algorithm, so the results are the same; the partial sums are
+ * kept in the result matrix between blocks, and overflow is checked when a sum
+ * is complete. The best block size depends on the size of the cache, and on
+ * how much time the arithmetic itself takes; core_tune_matrix_block_size()
+ * finds it by trying several. If the block size is 0, or the cache can't be
+ * allocated, the basic algorithm is used.
+ * The same code handles real and complex operands, which differ only in the
+ * inner loop.
+ * Large products are split into ranges of rows, each computed by a thread of
+ * its own, with its own cache, while the worker just waits for them to finish.
+ */
+
+struct mul_blocked_struct {
+    phloat *l, *r, *p;
+    bool lcpx, rcpx;
+    int4 m, n, q;
+    int4 bs;
+    phloat *cache;
+    // The current block, and the next row to do in it
+    int4 i, j, k, ii;
+};
+
+static bool mul_blocked_init(mul_blocked_struct *b, int4 bs) {
+    int4 rows = b->q < bs ? b->q : bs;
+    int4 cols = b->n < bs ? b->n : bs;
+    b->bs = bs;
+    b->cache = (phloat *) malloc(rows * cols * (b->rcpx ? 2 : 1) * sizeof(phloat));
+    b->i = b->j = b->k = b->ii = 0;
+    return b->cache != NULL;
+}
+
+static int mul_check_range(phloat *sum) {
+    int inf = p_isinf(*sum);
+    if (inf != 0) {
+        if (core_settings.matrix_outofrange && !flags.f.range_error_ignore)
+            return ERR_OUT_OF_RANGE;
+        *sum = inf < 0 ? NEG_HUGE_PHLOAT : POS_HUGE_PHLOAT;
+    }
+    return ERR_NONE;
+}
+
+/* Does rows of the current block, and moves on to the following blocks, until
+ * at least 'budget' multiply-adds have been done. Returns ERR_INTERRUPTIBLE if
+ * there is more to do, ERR_NONE when the product is complete, or
+ * ERR_OUT_OF_RANGE.
+ */
+static int mul_blocked_step(mul_blocked_struct *b, int4 budget) {
+    int4 m = b->m, n = b->n, q = b->q, bs = b->bs;
+    phloat *cache = b->cache;
+    int4 count = 0;
+    int err;
+
+    while (true) {
+        if (count >= budget)
+            return ERR_INTERRUPTIBLE;
+        int4 i = b->i, j = b->j, k = b->k;
+        int4 iimax = m - i;
+        if (iimax > bs)
+            iimax = bs;
+        int4 jjmax = n - j;
+        if (jjmax > bs)
+            jjmax = bs;
+        int4 kkmax = q - k;
+        if (kkmax > bs)
+            kkmax = bs;
+        bool first = k == 0;
+        bool last = k + kkmax == q;
+
+        if (b->ii == 0) {
+            int4 jj, kk;
+            if (b->rcpx)
+                for (kk = 0; kk < kkmax; kk++) {
+                    phloat *src = b->r + 2 * ((kk + k) * n + j);
+                    for (jj = 0; jj < jjmax; jj++) {
+                        cache[2 * (jj * kkmax + kk)] = src[2 * jj];
+                        cache[2 * (jj * kkmax + kk) + 1] = src[2 * jj + 1];
+                    }
+                }
+            else
+                for (kk = 0; kk < kkmax; kk++) {
+                    phloat *src = b->r + (kk + k) * n + j;
+                    for (jj = 0; jj < jjmax; jj++)
+                        cache[jj * kkmax + kk] = src[jj];
+                }
+        }
+
+        for (; b->ii < iimax; b->ii++) {
+            if (count >= budget)
+                return ERR_INTERRUPTIBLE;
+            int4 row = i + b->ii;
+            int4 jj, kk;
+            if (!b->lcpx && !b->rcpx) {
+                phloat *l = b->l + row * q + k;
+                phloat *p = b->p + row * n + j;
+                for (jj = 0; jj < jjmax; jj++) {
+                    phloat *r = cache + jj * kkmax;
+                    phloat sum = first ? 0 : p[jj];
+                    for (kk = 0; kk < kkmax; kk++)
+                        sum += l[kk] * r[kk];
+                    if (last && (err = mul_check_range(&sum)) != ERR_NONE)
+                        return err;
+                    p[jj] = sum;
+                }
+            } else {
+                phloat *l = b->l + (b->lcpx ? 2 : 1) * (row * q + k);
+                phloat *p = b->p + 2 * (row * n + j);
+                for (jj = 0; jj < jjmax; jj++) {
+                    phloat *r = cache + (b->rcpx ? 2 : 1) * jj * kkmax;
+                    phloat sum_re = first ? 0 : p[2 * jj];
+                    phloat sum_im = first ? 0 : p[2 * jj + 1];
+                    if (!b->lcpx)
+                        for (kk = 0; kk < kkmax; kk++) {
+                            phloat tmp = l[kk];
+                            sum_re += tmp * r[2 * kk];
+                            sum_im += tmp * r[2 * kk + 1];
+                        }
+                    else if (!b->rcpx)
+                        for (kk = 0; kk < kkmax; kk++) {
+                            phloat tmp = r[kk];
+                            sum_re += tmp * l[2 * kk];
+                            sum_im += tmp * l[2 * kk + 1];
+                        }
+                    else
+                        for (kk = 0; kk < kkmax; kk++) {
+                            phloat l_re = l[2 * kk];
+                            phloat l_im = l[2 * kk + 1];
+                            phloat r_re = r[2 * kk];
+                            phloat r_im = r[2 * kk + 1];
+                            sum_re += l_re * r_re - l_im * r_im;
+                            sum_im += l_im * r_re + l_re * r_im;
+                        }
+                    if (last) {
+                        if ((err = mul_check_range(&sum_re)) != ERR_NONE)
+                            return err;
+                        if ((err = mul_check_range(&sum_im)) != ERR_NONE)
+                            return err;
+                    }
+                    p[2 * jj] = sum_re;
+                    p[2 * jj + 1] = sum_im;
+                }
+            }
+            count += jjmax * kkmax;
+        }
+
+        b->ii = 0;
+        if ((b->k += bs) < q)
+            continue;
+        b->k = 0;
+        if ((b->j += bs) < n)
+            continue;
+        b->j = 0;
+        if ((b->i += bs) < m)
+            continue;
+        return ERR_NONE;
+    }
+}
+
+struct mul_blocked_data_struct {
+    mul_blocked_struct b;
+    // When multithreaded, each thread does a range of rows, with its own cache
+    int threads;
+    mul_blocked_struct *parts;
+    vartype *result;
+    int (*completion)(int error, vartype *result);
+};
+
+static mul_blocked_data_struct *mul_blocked_data;
+
+static int matrix_mul_blocked_worker(bool interrupted);
+static int matrix_mul_threaded_worker(bool interrupted);
+
+static void mul_parts_free(mul_blocked_data_struct *dat) {
+    for (int t = 0; t < dat->threads; t++)
+        free(dat->parts[t].cache);
+    free(dat->parts);
+}
+
+static bool mul_parts_init(mul_blocked_data_struct *dat, int4 bs) {
+    dat->parts = (mul_blocked_struct *)
+                        malloc(dat->threads * sizeof(mul_blocked_struct));
+    if (dat->parts == NULL)
+        return false;
+    for (int t = 0; t < dat->threads; t++) {
+        dat->parts[t] = dat->b;
+        if (!mul_blocked_init(&dat->parts[t], bs)) {
+            while (--t >= 0)
+                free(dat->parts[t].cache);
+            free(dat->parts);
+            return false;
+        }
+    }
+    return true;
+}
+
+/* Rows begin through end - 1 of the product, on a thread of its own */
+static void mul_blocked_slice(void *arg, int part, int4 begin, int4 end) {
+    mul_blocked_data_struct *dat = (mul_blocked_data_struct *) arg;
+    mul_blocked_struct *b = dat->parts + part;
+    b->l += (b->lcpx ? 2 : 1) * begin * b->q;
+    b->p += (b->lcpx || b->rcpx ? 2 : 1) * begin * b->n;
+    b->m = end - begin;
+    int err;
+    do
+        err = mul_blocked_step(b, 100000);
+    while (err == ERR_INTERRUPTIBLE && !linalg_job_cancelled());
+    if (err != ERR_NONE && err != ERR_INTERRUPTIBLE)
+        linalg_job_error(err);
+}
+
+static void mul_blocked_job(void *arg) {
+    mul_blocked_data_struct *dat = (mul_blocked_data_struct *) arg;
+    linalg_parallel(dat->b.m, dat->threads, mul_blocked_slice, dat);
+}
+
+/* Starts a blocked multiplication, for any combination of real and complex
+ * matrices, given the result matrix. Returns false if blocking is turned off,
+ * or if there isn't enough memory for it, in which case the caller should
+ * fall back on the basic algorithm.
+ */
+static bool matrix_mul_blocked(const vartype *left, const vartype *right,
+                               vartype *result,
+                               int (*completion)(int, vartype *)) {
+    int4 bs = core_settings.matrix_block_size;
+    if (bs <= 0)
+        return false;
+    mul_blocked_data_struct *dat =
+            (mul_blocked_data_struct *) malloc(sizeof(mul_blocked_data_struct));
+    if (dat == NULL)
+        return false;
+    mul_blocked_struct *b = &dat->b;
+    if (left->type == TYPE_REALMATRIX) {
+        vartype_realmatrix *rm = (vartype_realmatrix *) left;
+        b->l = rm->array->data;
+        b->lcpx = false;
+        b->m = rm->rows;
+        b->q = rm->columns;
+    } else {
+        vartype_complexmatrix *cm = (vartype_complexmatrix *) left;
+        b->l = cm->array->data;
+        b->lcpx = true;
+        b->m = cm->rows;
+        b->q = cm->columns;
+    }
+    if (right->type == TYPE_REALMATRIX) {
+        vartype_realmatrix *rm = (vartype_realmatrix *) right;
+        b->r = rm->array->data;
+        b->rcpx = false;
+        b->n = rm->columns;
+    } else {
+        vartype_complexmatrix *cm = (vartype_complexmatrix *) right;
+        b->r = cm->array->data;
+        b->rcpx = true;
+        b->n = cm->columns;
+    }
+    if (result->type == TYPE_REALMATRIX)
+        b->p = ((vartype_realmatrix *) result)->array->data;
+    else
+        b->p = ((vartype_complexmatrix *) result)->array->data;
+    dat->result = result;
+    dat->completion = completion;
+
+    dat->threads = linalg_threads((double) b->m * b->n * b->q);
+    mul_blocked_data = dat;
+    if (dat->threads > 1 && mul_parts_init(dat, bs)) {
+        if (linalg_start_job(mul_blocked_job, dat)) {
+            mode_interruptible = matrix_mul_threaded_worker;
+            mode_stoppable = false;
+            return true;
+        }
+        // Couldn't start the job thread; do it all on this thread instead
+        mul_parts_free(dat);
+    }
+    if (!mul_blocked_init(b, bs)) {
+        free(dat);
+        return false;
+    }
+    mode_interruptible = matrix_mul_blocked_worker;
+    mode_stoppable = false;
+    return true;
+}
+
+static int mul_blocked_finish(mul_blocked_data_struct *dat, int error);
+
+static int matrix_mul_blocked_worker(bool interrupted) {
+    mul_blocked_data_struct *dat = mul_blocked_data;
+    int error = interrupted ? ERR_INTERRUPTED : mul_blocked_step(&dat->b, 1000);
+    if (error == ERR_INTERRUPTIBLE)
+        return error;
+    free(dat->b.cache);
+    return mul_blocked_finish(dat, error);
+}
+
+static int matrix_mul_threaded_worker(bool interrupted) {
+    mul_blocked_data_struct *dat = mul_blocked_data;
+    int error;
+    if (interrupted) {
+        linalg_cancel_job();
+        error = ERR_INTERRUPTED;
+    } else if (!linalg_job_done(&error))
+        return ERR_INTERRUPTIBLE;
+    mul_parts_free(dat);
+    return mul_blocked_finish(dat, error);
+}
+
+static int mul_blocked_finish(mul_blocked_data_struct *dat, int error) {
+    int err;
+    if (error == ERR_NONE)
+        err = dat->completion(ERR_NONE, dat->result);
+    else {
+        err = dat->completion(error, NULL);
+        free_vartype(dat->result);
+    }
+    free(dat);
+    return err;
+}
+
+/* The time, in milliseconds, it takes to multiply two order-n real matrices,
+ * using the given block size, or using the basic algorithm if it is 0.
+ */
+static uint4 mul_time(phloat *l, phloat *r, phloat *p, int4 n, int4 bs) {
+    uint4 start = shell_milliseconds();
+    if (bs == 0) {
+        for (int4 i = 0; i < n; i++)
+            for (int4 j = 0; j < n; j++) {
+                phloat sum = 0;
+                for (int4 k = 0; k < n; k++)
+                    sum += l[i * n + k] * r[k * n + j];
+                p[i * n + j] = sum;
+            }
+    } else {
+        mul_blocked_struct b;
+        b.l = l;
+        b.r = r;
+        b.p = p;
+        b.lcpx = b.rcpx = false;
+        b.m = b.n = b.q = n;
+        if (!mul_blocked_init(&b, bs))
+            return (uint4) -1;
+        mul_blocked_step(&b, n * n * n);
+        free(b.cache);
+    }
+    return shell_milliseconds() - start;
+}
+
+int4 linalg_tune_block_size() {
+    static const int4 sizes[] = { 0, 16, 24, 32, 48, 64, 96, 128 };
+    const int nsizes = sizeof(sizes) / sizeof(sizes[0]);
+
+    // Use matrices big enough not to fit in the cache, but don't take
+    // forever: start small, and double the size as long as it's fast.
+    phloat *l = NULL, *r = NULL, *p = NULL;
+    int4 n = 64;
+    while (true) {
+        free(l);
+        free(r);
+        free(p);
+        l = (phloat *) malloc(n * n * sizeof(phloat));
+        r = (phloat *) malloc(n * n * sizeof(phloat));
+        p = (phloat *) malloc(n * n * sizeof(phloat));
+        if (l == NULL || r == NULL || p == NULL) {
+            free(l);
+            free(r);
+            free(p);
+            return core_settings.matrix_block_size;
+        }
+        uint4 seed = 1;
+        for (int4 i = 0; i < n * n; i++) {
+            seed = seed * 1103515245 + 12345;
+            l[i] = (int4) (seed >> 16) / (phloat) 65536;
+            seed = seed * 1103515245 + 12345;
+            r[i] = (int4) (seed >> 16) / (phloat) 65536;
+        }
+        if (n >= 512 || mul_time(l, r, p, n, 0) >= 100)
+            break;
+        n *= 2;
+    }
+
+    int4 best = 0;
+    uint4 best_time = (uint4) -1;
+    for (int i = 0; i < nsizes; i++) {
+        // Best of two, to reduce the influence of whatever else the
+        // machine is doing
+        uint4 t1 = mul_time(l, r, p, n, sizes[i]);
+        uint4 t2 = mul_time(l, r, p, n, sizes[i]);
+        uint4 t = t1 < t2 ? t1 : t2;
+        if (t < best_time) {
+            best = sizes[i];
+            best_time = t;
+        }
+    }
+    free(l);
+    free(r);
+    free(p);
+    core_settings.matrix_block_size = best;
+    return best;
+}
+
 struct mul_rr_data_struct {
     vartype_realmatrix *left;
     vartype_realmatrix *right;
@@ -317,6 +721,12 @@ static int matrix_mul_rr(vartype_realmatrix *left, vartype_realmatrix *right,
         goto finished;
     }
 
+    if (matrix_mul_blocked((vartype *) left, (vartype *) right, dat->result,
+                           completion)) {
+        free(dat);
+        return ERR_INTERRUPTIBLE;
+    }
+
     dat->left = left;
     dat->right = right;
     dat->i = 0;
@@ -391,143 +801,6 @@ static int matrix_mul_rr_worker(bool interrupted) {
     return ERR_INTERRUPTIBLE;
 }
 
-#if 0
-/* TODO: Blocked matrix multiplication
- * This commented-out function implements a working blocked matrix
- * multiplication algorithm. It works by breaking up the multiplication into
- * multiplications of submatrices of the multiplicands. If the submatrices are
- * sufficiently small, they can be made to fit entirely in the CPU's L1 cache.
- * With block sizes of around 45, I have observed a speed-up factor of circa
- * 1.7 on a Pentium MMX, and with block sizes of about 90, I have observed a
- * speed-up factor of circa 3 on a Duron. (Those were the optimum block sizes
- * observed for each processor.) These numbers suggest the Pentium MMX has a 32
- * kilobyte L1 cache, and the Duron has a 128 kilobyte L1 cache.
- * For production use, the block size should be a user-configurable parameter,
- * with a built-in tool to automatically determine the optimum value. Since the
- * UI for this kind of advanced configuration does not exist yet, and sice the
- * determination of optimum block size is a very slow process, and since I
- * expect most HP-42S users will not be very interested in using a calculator
- * to work with order-100+ matrices, and since even in the optimum case the
- * speed-up is not staggering, I'm putting full implementation of this feature
- * off until some later date.
- */
-static int matrix_mul_rr(vartype_realmatrix *left, vartype_realmatrix *right,
-                         vartype **result) {
-    phloat *cache = NULL;
-    phloat *leftcache, *rightcache;
-
-    phloat *l = left->array->data;
-    phloat *r = right->array->data;
-    phloat *p;
-    int inf;
-    int4 m, n, q;
-    int4 i, j, k;
-
-    q = left->columns;
-    if (q != right->rows)
-        return ERR_DIMENSION_ERROR;
-    m = left->rows;
-    n = right->columns;
-
-    if (contains_strings(left) || contains_strings(right))
-        return ERR_ALPHA_DATA_IS_INVALID;
-
-    *result = new_realmatrix(m, n);
-    if (*result == NULL)
-        return ERR_INSUFFICIENT_MEMORY;
-    p = ((vartype_realmatrix *) *result)->array->data;
-
-    if (BLOCK_SIZE > 0) {
-        int4 cachesize = 2 * BLOCK_SIZE * BLOCK_SIZE;
-        int4 alignment = CACHE_ALIGNMENT;
-        int4 misalgn;
-        if (alignment == 0)
-            alignment = 1;
-        misalgn = alignment % sizeof(phloat);
-        if (misalgn != 0)
-            alignment += sizeof(phloat) - misalgn;
-
-        cache = (phloat *) malloc(cachesize * sizeof(phloat) + alignment);
-        if (cache != NULL) {
-            misalgn = ((unsigned long) cache) % alignment;
-            if (misalgn == 0)
-                leftcache = cache;
-            else
-                leftcache = cache + (alignment - misalgn) / sizeof(phloat);
-            rightcache = leftcache + BLOCK_SIZE * BLOCK_SIZE;
-        }
-    }
-
-    if (cache == NULL) {
-
-        /* Falling back on basic i,j,k algorithm */
-        for (i = 0; i < m; i++)
-            for (j = 0; j < n; j++) {
-                phloat sum = 0;
-                for (k = 0; k < q; k++)
-                    sum += l[i * q + k] * r[k * n + j];
-                if ((inf = p_isinf(sum)) != 0) {
-                    if (core_settings.matrix_outofrange
-                                            && !flags.f.range_error_ignore)
-                        return ERR_OUT_OF_RANGE;
-                    else
-                        sum = inf < 0 ? NEG_HUGE_PHLOAT : POS_HUGE_PHLOAT;
-                }
-                p[i * n + j] = sum;
-            }
-        return ERR_NONE;
-
-    } else {
-
-        /* Blocked i,j,k algorithm for optimal cache utilization */
-        int4 i, j, k, ii, jj, kk;
-        for (i = 0; i < m; i += BLOCK_SIZE) {
-            int4 iimax = m - i;
-            if (iimax > BLOCK_SIZE)
-                iimax = BLOCK_SIZE;
-            for (j = 0; j < n; j += BLOCK_SIZE) {
-                int4 jjmax = n - j;
-                if (jjmax > BLOCK_SIZE)
-                    jjmax = BLOCK_SIZE;
-                for (k = 0; k < q; k += BLOCK_SIZE) {
-                    int4 kkmax = q - k;
-                    if (kkmax > BLOCK_SIZE)
-                        kkmax = BLOCK_SIZE;
-                    for (ii = 0; ii < iimax; ii++)
-                        for (kk = 0; kk < kkmax; kk++)
-                            leftcache[ii * BLOCK_SIZE + kk]
-                                = l[(ii + i) * q + (kk + k)];
-                    for (kk = 0; kk < kkmax; kk++)
-                        for (jj = 0; jj < jjmax; jj++)
-                            rightcache[kk * BLOCK_SIZE + jj]
-                                = r[(kk + k) * n + (jj + j)];
-                    for (ii = 0; ii < iimax; ii++)
-                        for (jj = 0; jj < jjmax; jj++) {
-                            phloat sum = p[(ii + i) * n + (jj + j)];
-                            for (kk = 0; kk < kkmax; kk++)
-                                sum += leftcache[ii * BLOCK_SIZE + kk]
-                                        * rightcache[kk * BLOCK_SIZE + jj];
-                            if ((inf = p_isinf(sum)) != 0) {
-                                if (core_settings.matrix_outofrange
-                                            && !flags.f.range_error_ignore) {
-                                    free(cache);
-                                    return ERR_OUT_OF_RANGE;
-                                } else
-                                    sum = inf < 0 ? NEG_HUGE_PHLOAT
-                                                  : POS_HUGE_PHLOAT;
-                            }
-                            p[(ii + i) * n + (jj + j)] = sum;
-                        }
-                }
-            }
-        }
-        free(cache);
-        return ERR_NONE;
-
-    }
-}
-#endif
-
 struct mul_rc_data_struct {
     vartype_realmatrix *left;
     vartype_complexmatrix *right;
@@ -570,6 +843,12 @@ static int matrix_mul_rc(vartype_realmatrix *left, vartype_complexmatrix *right,
         goto finished;
     }
 
+    if (matrix_mul_blocked((vartype *) left, (vartype *) right, dat->result,
+                           completion)) {
+        free(dat);
+        return ERR_INTERRUPTIBLE;
+    }
+
     dat->left = left;
     dat->right = right;
     dat->i = 0;
@@ -702,6 +981,12 @@ static int matrix_mul_cr(vartype_complexmatrix *left, vartype_realmatrix *right,
         goto finished;
     }
 
+    if (matrix_mul_blocked((vartype *) left, (vartype *) right, dat->result,
+                           completion)) {
+        free(dat);
+        return ERR_INTERRUPTIBLE;
+    }
+
     dat->left = left;
     dat->right = right;
     dat->i = 0;
@@ -829,6 +1114,12 @@ static int matrix_mul_cc(vartype_complexmatrix *left, vartype_complexmatrix *rig
         goto finished;
     }
 
+    if (matrix_mul_blocked((vartype *) left, (vartype *) right, dat->result,
+                           completion)) {
+        free(dat);
+        return ERR_INTERRUPTIBLE;
+    }
+
     dat->left = left;
     dat->right = right;
     dat->i = 0;
@@ -990,7 +1281,8 @@ int linalg_inv(const vartype *src, void (*completion)(int, vartype *)) {
         matrix_copy(lu, src);
         linalg_inv_completion = completion;
         linalg_inv_result = inv;
-        return lu_decomp_r((vartype_realmatrix *) lu, perm, inv_r_completion1);
+        return lu_decomp_r_cached(src, (vartype_realmatrix *) lu, perm,
+                                                    inv_r_completion1);
     } else {
         vartype_complexmatrix *ma = (vartype_complexmatrix *) src;
         vartype *lu, *inv;
@@ -1014,7 +1306,7 @@ int linalg_inv(const vartype *src, void (*completion)(int, vartype *)) {
         matrix_copy(lu, src);
         linalg_inv_completion = completion;
         linalg_inv_result = inv;
-        return lu_decomp_c((vartype_complexmatrix *) lu, perm,
+        return lu_decomp_c_cached(src, (vartype_complexmatrix *) lu, perm,
                                                     inv_c_completion1);
     }
 }
@@ -1129,7 +1421,7 @@ int linalg_det(const vartype *src, void (*completion)(int, vartype *)) {
         core_settings.matrix_singularmatrix = true;
 
         linalg_det_completion = completion;
-        return lu_decomp_r(ma, perm, det_r_completion); 
+        return lu_decomp_r_cached(src, ma, perm, det_r_completion);
     } else /* src->type == TYPE_COMPLEXMATRIX */ {
         vartype_complexmatrix *ma = (vartype_complexmatrix *) src;
         n = ma->rows;
@@ -1160,7 +1452,7 @@ int linalg_det(const vartype *src, void (*completion)(int, vartype *)) {
         core_settings.matrix_singularmatrix = true;
 
         linalg_det_completion = completion;
-        return lu_decomp_c(ma, perm, det_c_completion); 
+        return lu_decomp_c_cached(src, ma, perm, det_c_completion);
     }
 }
 
@@ -16,6 +16,17 @@
  *****************************************************************************/
 
 #include <stdlib.h>
+#include <string.h>
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <mutex>
+#include <thread>
+#ifdef WINDOWS
+#include <process.h>
+#else
+#include <pthread.h>
+#endif
 
 #include "core_linalg2.h"
 #include "core_globals.h"
@@ -32,23 +43,235 @@
         ;
 
 
+/*******************/
+/***** Threads *****/
+/*******************/
+
+// Operations smaller than this many multiply-adds are done on one thread
+#define MIN_THREADED_WORK 2000000
+
+int linalg_threads(double work) {
+    if (work < MIN_THREADED_WORK)
+        return 1;
+    int n = core_settings.matrix_threads;
+    if (n == 0)
+        n = std::thread::hardware_concurrency();
+    if (n < 1)
+        n = 1;
+    else if (n > 64)
+        n = 64;
+    return n;
+}
+
+/* Threads are started with the platform's own API rather than std::thread,
+ * because the std::thread constructor reports failure by throwing, and
+ * since we're built with -fno-exceptions, that would abort. All threads are
+ * detached; the ones that need waiting for signal that they're done
+ * themselves.
+ * In the decimal version, the threads do their arithmetic with the Intel
+ * library, which keeps its status flags in a global variable; depending on
+ * how the library was built, that is shared by all threads, so they may set
+ * flags in it at the same time, and updates may be lost. That is harmless,
+ * since the core never reads or clears those flags. The rounding mode, which
+ * the library does read, is never changed, so every thread sees the same
+ * one.
+ */
+#ifdef WINDOWS
+static void __cdecl thread_main(void *arg) {
+    ((void (*)()) arg)();
+}
+
+static bool start_thread(void (*f)()) {
+    return _beginthread(thread_main, 0, (void *) f) != (uintptr_t) -1;
+}
+#else
+static void *thread_main(void *arg) {
+    ((void (*)()) arg)();
+    return NULL;
+}
+
+static bool start_thread(void (*f)()) {
+    pthread_t t;
+    if (pthread_create(&t, NULL, thread_main, (void *) f) != 0)
+        return false;
+    pthread_detach(t);
+    return true;
+}
+#endif
+
+/* The thread pool. The worker threads are created as needed, and then wait
+ * for work for as long as the process lives; the synchronization objects
+ * are never deleted, so they can't be destroyed from under them at exit.
+ * If a worker thread can't be created, the parts are shared among the ones
+ * that do exist, and the calling thread, which always does parts as well.
+ */
+static std::mutex *pool_mutex = NULL;
+static std::condition_variable *pool_work, *pool_idle;
+static int pool_size = 0;
+static void (*task_func)(void *arg, int part, int4 begin, int4 end);
+static void *task_arg;
+static int4 task_n;
+static int task_parts = 0, task_next = 0, task_done = 0;
+
+/* Does parts of the current task, until there are none left to start.
+ * Called with pool_mutex locked.
+ */
+static void pool_run_parts(std::unique_lock<std::mutex> &lock) {
+    while (task_next < task_parts) {
+        int part = task_next++;
+        void (*f)(void *, int, int4, int4) = task_func;
+        void *arg = task_arg;
+        int4 begin = (int4) ((int8) task_n * part / task_parts);
+        int4 end = (int4) ((int8) task_n * (part + 1) / task_parts);
+        lock.unlock();
+        f(arg, part, begin, end);
+        lock.lock();
+        if (++task_done == task_parts)
+            pool_idle->notify_all();
+    }
+}
+
+static void pool_thread() {
+    std::unique_lock<std::mutex> lock(*pool_mutex);
+    while (true) {
+        pool_work->wait(lock, [] { return task_next < task_parts; });
+        pool_run_parts(lock);
+    }
+}
+
+void linalg_parallel(int4 n, int parts,
+                     void (*f)(void *arg, int part, int4 begin, int4 end),
+                     void *arg) {
+    if (parts > n)
+        parts = n;
+    if (parts <= 1) {
+        f(arg, 0, 0, n);
+        return;
+    }
+    if (pool_mutex == NULL) {
+        pool_mutex = new std::mutex;
+        pool_work = new std::condition_variable;
+        pool_idle = new std::condition_variable;
+    }
+    std::unique_lock<std::mutex> lock(*pool_mutex);
+    // The calling thread does parts as well
+    while (pool_size < parts - 1) {
+        if (!start_thread(pool_thread))
+            break;
+        pool_size++;
+    }
+    task_func = f;
+    task_arg = arg;
+    task_n = n;
+    task_parts = parts;
+    task_next = 0;
+    task_done = 0;
+    pool_work->notify_all();
+    pool_run_parts(lock);
+    pool_idle->wait(lock, [] { return task_done == task_parts; });
+}
+
+/* The background job. There is only one at a time, since there is only one
+ * interruptible operation at a time.
+ */
+static std::mutex *job_mutex = NULL;
+static std::condition_variable *job_finished_cond;
+static void (*job_func)(void *arg);
+static void *job_arg;
+static bool job_finished;
+static int job_error;
+static std::atomic<bool> job_cancel;
+
+static void job_main() {
+    job_func(job_arg);
+    std::lock_guard<std::mutex> lock(*job_mutex);
+    job_finished = true;
+    job_finished_cond->notify_all();
+}
+
+bool linalg_start_job(void (*job)(void *arg), void *arg) {
+    if (job_mutex == NULL) {
+        job_mutex = new std::mutex;
+        job_finished_cond = new std::condition_variable;
+    }
+    {
+        // The previous job's thread may still be on its way out
+        std::lock_guard<std::mutex> lock(*job_mutex);
+        job_func = job;
+        job_arg = arg;
+        job_finished = false;
+        job_error = ERR_NONE;
+    }
+    job_cancel = false;
+    return start_thread(job_main);
+}
+
+bool linalg_job_done(int *error) {
+    std::unique_lock<std::mutex> lock(*job_mutex);
+    if (!job_finished_cond->wait_for(lock, std::chrono::milliseconds(10),
+                                      [] { return job_finished; }))
+        return false;
+    *error = job_error;
+    return true;
+}
+
+void linalg_cancel_job() {
+    job_cancel = true;
+    std::unique_lock<std::mutex> lock(*job_mutex);
+    job_finished_cond->wait(lock, [] { return job_finished; });
+}
+
+bool linalg_job_cancelled() {
+    return job_cancel;
+}
+
+void linalg_job_error(int error) {
+    std::lock_guard<std::mutex> lock(*job_mutex);
+    if (job_error == ERR_NONE)
+        job_error = error;
+}
+
+
 /****************************/
 /***** LU decomposition *****/
 /****************************/
 
+/* LU decomposition
+ * This is Crout's method with implicit partial pivoting, organized as a
+ * right-looking, blocked algorithm. The matrix is factored in panels of
+ * core_settings.matrix_block_size columns; after each panel, the rows of U to
+ * its right are finished, and then the rest of the matrix is updated by all
+ * of the panel's columns at once, one row at a time, so the inner loops run
+ * along contiguous rows, and each panel row stays in the cache while it is
+ * used for all the rows below it. Every element still has the same terms
+ * subtracted from it, in the same order, as in the element-at-a-time method,
+ * so the results are the same.
+ * The work is done in steps of one column of a panel, or one row; the
+ * interruptible worker does steps until it has done about 1000
+ * multiply-adds. For large matrices, the job thread does the same steps,
+ * except that it splits the rows of each update among the pool threads.
+ */
+
 struct lu_r_data_struct {
     vartype_realmatrix *a;
     int4 *perm;
-    phloat det;
-    int4 i, imax, j, k;
-    phloat max, tmp, sum, *scale;
+    phloat det, *scale;
+    int4 bs;
+    // The current panel is columns j0 through j1 - 1. In state 0, step is
+    // the next row to scale; in state 1, the next column of the panel to
+    // factor; in state 2, the next row of U to finish; in state 3, the next
+    // row to update.
+    int4 j0, j1, step;
     int state;
+    int threads;
     int (*completion)(int, vartype_realmatrix *, int4 *, phloat);
 };
 
 lu_r_data_struct *lu_r_data;
 
 static int lu_decomp_r_worker(bool interrupted);
+static int lu_decomp_r_job_worker(bool interrupted);
+static void lu_r_job(void *arg);
 
 int lu_decomp_r(vartype_realmatrix *a, int4 *perm,
                 int (*completion)(int, vartype_realmatrix *, int4 *, phloat)) {
@@ -67,171 +290,263 @@ int lu_decomp_r(vartype_realmatrix *a, int4 *perm,
     dat->a = a;
     dat->perm = perm;
     dat->completion = completion;
+    dat->bs = core_settings.matrix_block_size;
+    if (dat->bs < 1)
+        dat->bs = 1;
 
+    dat->det = 1;
     dat->state = 0;
+    dat->step = 0;
+    dat->threads = linalg_threads((double) a->rows * a->rows * a->rows / 3);
 
     lu_r_data = dat;
-    mode_interruptible = lu_decomp_r_worker;
+    // If the job thread can't be started, do it all on this thread
+    if (dat->threads > 1 && linalg_start_job(lu_r_job, dat))
+        mode_interruptible = lu_decomp_r_job_worker;
+    else
+        mode_interruptible = lu_decomp_r_worker;
     mode_stoppable = false;
     return ERR_INTERRUPTIBLE;
 }
 
-static int lu_decomp_r_worker(bool interrupted) {
-    
-    lu_r_data_struct *dat = lu_r_data;
-
+/* Finds the pivot for column j, swaps it into place, divides the rest of the
+ * column by it, and subtracts its multiples of row j from the rest of the
+ * panel.
+ */
+static int lu_r_column(lu_r_data_struct *dat, int4 j) {
     phloat *a = dat->a->array->data;
     int4 n = dat->a->rows;
     phloat *scale = dat->scale;
-    int4 *perm = dat->perm;
-    int count = 1000;
-    int err;
-
-    int4 i = dat->i;
-    int4 imax = dat->imax;
-    int4 j = dat->j;
-    int4 k = dat->k;
-    phloat max = dat->max;
-    phloat tmp = dat->tmp;
-    phloat sum = dat->sum;
-
-    if (interrupted) {
-        free(scale);
-        err = dat->completion(ERR_INTERRUPTED, dat->a, perm, 0);
-        free(dat);
-        return err;
+    int4 j1 = dat->j1;
+    int4 i, imax, k;
+    phloat max, tmp;
+
+    max = 0;
+    imax = j;
+    for (i = j; i < n; i++) {
+        if (scale[i] == 0) {
+            imax = i;
+            break;
+        }
+        tmp = a[i * n + j];
+        tmp = (tmp < 0 ? -tmp : tmp) / scale[i];
+        if (tmp > max) {
+            imax = i;
+            max = tmp;
+        }
     }
 
-    switch (dat->state) {
-        case 0: break;
-        case 1: goto state1;
-        case 2: goto state2;
-        case 3: goto state3;
-        case 4: goto state4;
-        case 5: goto state5;
+    if (j != imax) {
+        for (k = 0; k < n; k++) {
+            tmp = a[imax * n + k];
+            a[imax * n + k] = a[j * n + k];
+            a[j * n + k] = tmp;
+        }
+        dat->det = -dat->det;
+        scale[imax] = scale[j];
     }
 
-    dat->det = 1;
-
-    for (i = 0; i < n; i++) {
-        max = 0;
-        for (j = 0; j < n; j++) {
-            tmp = a[i * n + j];
-            if (tmp < 0)
-                tmp = -tmp;
-            if (tmp > max)
-                max = tmp;
-            STATE(1);
+    dat->perm[j] = imax;
+    if (a[j * n + j] == 0) {
+        if (core_settings.matrix_singularmatrix)
+            return ERR_SINGULAR_MATRIX;
+        /* For a zero pivot, substitute a small positive number.
+         * I use a number that's about 10^-20 times the size of
+         * the maximum of the original column, with a minimum of
+         * 10^20 / POS_HUGE_PHLOAT.
+         */
+        phloat tiniest = 1e20 / POS_HUGE_PHLOAT;
+        phloat tiny;
+        if (scale[j] == 0)
+            tiny = tiniest;
+        else {
+            tiny = pow(10, floor(log10(scale[j])) - 20);
+            if (tiny < tiniest)
+                tiny = tiniest;
         }
-        scale[i] = max;
+        a[j * n + j] = tiny;
     }
-
-    for (j = 0; j < n; j++) {
-        for (i = 0; i < j; i++) {
-            sum = a[i * n + j];
-            for (k = 0; k < i; k++) {
-                sum -= a[i * n + k] * a[k * n + j];
-                STATE(2);
-            }
-            a[i * n + j] = sum;
+    dat->det *= a[j * n + j];
+    if (j != n - 1) {
+        tmp = 1 / a[j * n + j];
+        for (i = j + 1; i < n; i++) {
+            phloat *row = a + i * n;
+            row[j] *= tmp;
+            phloat l = row[j];
+            for (k = j + 1; k < j1; k++)
+                row[k] -= l * a[j * n + k];
         }
+    }
+    return ERR_NONE;
+}
 
-        max = 0;
-        imax = j;
-        for (i = j; i < n; i++) {
-            sum = a[i * n + j];
-            for (k = 0; k < j; k++) {
-                sum -= a[i * n + k] * a[k * n + j];
-                STATE(3);
-            }
-            a[i * n  + j] = sum;
-            if (scale[i] == 0) {
-                imax = i;
+/* Subtracts the multiples, given by 'count' elements of row starting at
+ * column k, of the rows of U starting at row k, from the part of row right of
+ * column j1 - 1.
+ */
+static void lu_r_subtract(phloat *a, int4 n, phloat *row, int4 k, int4 count,
+                          int4 j1) {
+    for (; count > 0; k++, count--) {
+        phloat l = row[k];
+        phloat *u = a + k * n;
+        for (int4 c = j1; c < n; c++)
+            row[c] -= l * u[c];
+    }
+}
+
+/* Updates rows j1 + begin through j1 + end - 1, right of the panel */
+static void lu_r_update(void *arg, int part, int4 begin, int4 end) {
+    lu_r_data_struct *dat = (lu_r_data_struct *) arg;
+    phloat *a = dat->a->array->data;
+    int4 n = dat->a->rows;
+    int4 j0 = dat->j0, j1 = dat->j1;
+    for (int4 i = j1 + begin; i < j1 + end; i++)
+        lu_r_subtract(a, n, a + i * n, j0, j1 - j0, j1);
+}
+
+/* Does one step, and adds the number of multiply-adds it took to *count.
+ * Returns ERR_INTERRUPTIBLE if there is more to do, ERR_NONE when the
+ * decomposition is complete, or ERR_SINGULAR_MATRIX.
+ */
+static int lu_r_step(lu_r_data_struct *dat, int4 *count) {
+    phloat *a = dat->a->array->data;
+    int4 n = dat->a->rows;
+    int4 step = dat->step;
+    int4 j0 = dat->j0, j1 = dat->j1;
+    int err;
+
+    switch (dat->state) {
+        case 0: {
+            if (step == n) {
+                dat->j0 = 0;
+                dat->j1 = dat->bs < n ? dat->bs : n;
+                dat->state = 1;
+                dat->step = 0;
                 break;
             }
-            tmp = (sum < 0 ? -sum : sum) / scale[i];
-            if (tmp > max) {
-                imax = i;
-                max = tmp;
+            phloat max = 0;
+            for (int4 c = 0; c < n; c++) {
+                phloat tmp = a[step * n + c];
+                if (tmp < 0)
+                    tmp = -tmp;
+                if (tmp > max)
+                    max = tmp;
             }
+            dat->scale[step] = max;
+            *count += n;
+            dat->step++;
+            break;
         }
-
-        if (j != imax) {
-            for (k = 0; k < n; k++) {
-                tmp = a[imax * n + k];
-                a[imax * n + k] = a[j * n + k];
-                a[j * n + k] = tmp;
-                STATE(4);
+        case 1: {
+            if (step == j1) {
+                dat->state = 2;
+                dat->step = j0;
+                break;
             }
-            dat->det = -dat->det;
-            scale[imax] = scale[j];
-        }
-
-        perm[j] = imax;
-        if (a[j * n + j] == 0) {
-            if (core_settings.matrix_singularmatrix) {
-                free(scale);
-                err = dat->completion(ERR_SINGULAR_MATRIX, dat->a, perm, 0);
-                free(dat);
+            if ((err = lu_r_column(dat, step)) != ERR_NONE)
                 return err;
-            } else {
-                /* For a zero pivot, substitute a small positive number.
-                 * I use a number that's about 10^-20 times the size of
-                 * the maximum of the original column, with a minimum of
-                 * 10^20 / POS_HUGE_PHLOAT.
-                 */
-                phloat tiniest = 1e20 / POS_HUGE_PHLOAT;
-                phloat tiny;
-                if (scale[j] == 0)
-                    tiny = tiniest;
-                else {
-                    tiny = pow(10, floor(log10(scale[j])) - 20);
-                    if (tiny < tiniest)
-                        tiny = tiniest;
-                }
-                a[j * n + j] = tiny;
+            *count += (n - step) * (j1 - step);
+            dat->step++;
+            break;
+        }
+        case 2: {
+            if (step == j1) {
+                dat->state = 3;
+                break;
             }
+            lu_r_subtract(a, n, a + step * n, j0, step - j0, j1);
+            *count += (step - j0 + 1) * (n - j1);
+            dat->step++;
+            break;
         }
-        dat->det *= a[j * n + j];
-        if (j != n - 1) {
-            tmp = 1 / a[j * n + j];
-            for (i = j + 1; i < n; i++) {
-                a[i * n + j] *= tmp;
-                STATE(5);
+        case 3: {
+            if (step == n) {
+                if (j1 == n)
+                    return ERR_NONE;
+                dat->j0 = j1;
+                dat->j1 = n - j1 > dat->bs ? j1 + dat->bs : n;
+                dat->state = 1;
+                dat->step = j1;
+                break;
             }
+            lu_r_update(dat, 0, step - j1, step - j1 + 1);
+            *count += (j1 - j0) * (n - j1);
+            dat->step++;
+            break;
         }
     }
+    return ERR_INTERRUPTIBLE;
+}
 
-    free(scale);
-    err = dat->completion(ERR_NONE, dat->a, perm, dat->det);
+static int lu_r_finish(lu_r_data_struct *dat, int error) {
+    free(dat->scale);
+    int err = dat->completion(error, dat->a, dat->perm,
+                              error == ERR_NONE ? dat->det : 0);
     free(dat);
     return err;
+}
 
-    suspend:
-    dat->i = i;
-    dat->imax = imax;
-    dat->j = j;
-    dat->k = k;
-    dat->max = max;
-    dat->tmp = tmp;
-    dat->sum = sum;
-    return ERR_INTERRUPTIBLE;
+static int lu_decomp_r_worker(bool interrupted) {
+    lu_r_data_struct *dat = lu_r_data;
+    if (interrupted)
+        return lu_r_finish(dat, ERR_INTERRUPTED);
+    int4 count = 0;
+    int err;
+    do
+        err = lu_r_step(dat, &count);
+    while (err == ERR_INTERRUPTIBLE && count < 1000);
+    if (err == ERR_INTERRUPTIBLE)
+        return err;
+    return lu_r_finish(dat, err);
+}
+
+static void lu_r_job(void *arg) {
+    lu_r_data_struct *dat = (lu_r_data_struct *) arg;
+    int4 n = dat->a->rows;
+    int4 count = 0;
+    int err;
+    do {
+        if (linalg_job_cancelled())
+            return;
+        if (dat->state == 3 && dat->step == dat->j1) {
+            linalg_parallel(n - dat->j1, dat->threads, lu_r_update, dat);
+            dat->step = n;
+        }
+        err = lu_r_step(dat, &count);
+    } while (err == ERR_INTERRUPTIBLE);
+    if (err != ERR_NONE)
+        linalg_job_error(err);
+}
+
+static int lu_decomp_r_job_worker(bool interrupted) {
+    lu_r_data_struct *dat = lu_r_data;
+    int err;
+    if (interrupted) {
+        linalg_cancel_job();
+        err = ERR_INTERRUPTED;
+    } else if (!linalg_job_done(&err))
+        return ERR_INTERRUPTIBLE;
+    return lu_r_finish(dat, err);
 }
 
 
 struct lu_c_data_struct {
     vartype_complexmatrix *a;
     int4 *perm;
-    phloat det_re, det_im;
-    int4 i, imax, j, k;
-    phloat max, tmp, tmp_re, tmp_im, sum_re, sum_im, s_re, s_im, *scale;
+    phloat det_re, det_im, *scale;
+    int4 bs;
+    // See lu_r_data_struct
+    int4 j0, j1, step;
     int state;
+    int threads;
     int (*completion)(int, vartype_complexmatrix *, int4 *, phloat, phloat);
 };
 
 lu_c_data_struct *lu_c_data;
 
 static int lu_decomp_c_worker(bool interrupted);
+static int lu_decomp_c_job_worker(bool interrupted);
+static void lu_c_job(void *arg);
 
 int lu_decomp_c(vartype_complexmatrix *a, int4 *perm,
                 int (*completion)(int, vartype_complexmatrix *,
@@ -251,194 +566,443 @@ int lu_decomp_c(vartype_complexmatrix *a, int4 *perm,
     dat->a = a;
     dat->perm = perm;
     dat->completion = completion;
+    dat->bs = core_settings.matrix_block_size;
+    if (dat->bs < 1)
+        dat->bs = 1;
 
+    dat->det_re = 1;
+    dat->det_im = 0;
     dat->state = 0;
+    dat->step = 0;
+    dat->threads = linalg_threads((double) a->rows * a->rows * a->rows / 3);
 
     lu_c_data = dat;
-    mode_interruptible = lu_decomp_c_worker;
+    // If the job thread can't be started, do it all on this thread
+    if (dat->threads > 1 && linalg_start_job(lu_c_job, dat))
+        mode_interruptible = lu_decomp_c_job_worker;
+    else
+        mode_interruptible = lu_decomp_c_worker;
     mode_stoppable = false;
     return ERR_INTERRUPTIBLE;
 }
 
-static int lu_decomp_c_worker(bool interrupted) {
-    
-    lu_c_data_struct *dat = lu_c_data;
-
+/* See lu_r_column() */
+static int lu_c_column(lu_c_data_struct *dat, int4 j) {
     phloat *a = dat->a->array->data;
     int4 n = dat->a->rows;
     phloat *scale = dat->scale;
-    int4 *perm = dat->perm;
-    int count = 1000;
-    int err;
-
-    int4 i = dat->i;
-    int4 imax = dat->imax;
-    int4 j = dat->j;
-    int4 k = dat->k;
-    phloat max = dat->max;
-    phloat tmp = dat->tmp;
-    phloat tmp_re = dat->tmp_re;
-    phloat tmp_im = dat->tmp_im;
-    phloat sum_re = dat->sum_re;
-    phloat sum_im = dat->sum_im;
-    phloat s_re = dat->s_re;
-    phloat s_im = dat->s_im;
-
-    phloat xre, xim, yre, yim;
-    phloat tiniest = 1e20 / POS_HUGE_PHLOAT;
-    phloat tiny;
-
-    if (interrupted) {
-        free(scale);
-        err = dat->completion(ERR_INTERRUPTED, dat->a, perm, 0, 0);
-        free(dat);
-        return err;
+    int4 j1 = dat->j1;
+    int4 i, imax, k;
+    phloat max, tmp, tmp_re, tmp_im, s_re, s_im;
+
+    max = 0;
+    imax = j;
+    for (i = j; i < n; i++) {
+        if (scale[i] == 0) {
+            imax = i;
+            break;
+        }
+        tmp = hypot(a[2 * (i * n + j)], a[2 * (i * n + j) + 1]) / scale[i];
+        if (tmp > max) {
+            imax = i;
+            max = tmp;
+        }
     }
 
-    switch (dat->state) {
-        case 0: break;
-        case 1: goto state1;
-        case 2: goto state2;
-        case 3: goto state3;
-        case 4: goto state4;
-        case 5: goto state5;
+    if (j != imax) {
+        for (k = 0; k < n; k++) {
+            tmp = a[2 * (imax * n + k)];
+            a[2 * (imax * n + k)] = a[2 * (j * n + k)];
+            a[2 * (j * n + k)] = tmp;
+            tmp = a[2 * (imax * n + k) + 1];
+            a[2 * (imax * n + k) + 1] = a[2 * (j * n + k) + 1];
+            a[2 * (j * n + k) + 1] = tmp;
+        }
+        dat->det_re = -dat->det_re;
+        dat->det_im = -dat->det_im;
+        scale[imax] = scale[j];
     }
 
-    dat->det_re = 1;
-    dat->det_im = 0;
-
-    for (i = 0; i < n; i++) {
-        max = 0;
-        for (j = 0; j < n; j++) {
-            tmp = hypot(a[2 * (i * n + j)], a[2 * (i * n + j) + 1]);
-            if (tmp > max)
-                max = tmp;
-            STATE(1);
+    dat->perm[j] = imax;
+    tmp_re = a[2 * (j * n + j)];
+    tmp_im = a[2 * (j * n + j) + 1];
+    if (tmp_re == 0 && tmp_im == 0) {
+        if (core_settings.matrix_singularmatrix)
+            return ERR_SINGULAR_MATRIX;
+        // See lu_r_column()
+        phloat tiniest = 1e20 / POS_HUGE_PHLOAT;
+        phloat tiny;
+        if (scale[j] == 0)
+            tiny = tiniest;
+        else {
+            tiny = pow(10, floor(log10(scale[j])) - 20);
+            if (tiny < tiniest)
+                tiny = tiniest;
         }
-        scale[i] = max;
-    }
-
-    for (j = 0; j < n; j++) {
-        for (i = 0; i < j; i++) {
-            sum_re = a[2 * (i * n + j)];
-            sum_im = a[2 * (i * n + j) + 1];
-            for (k = 0; k < i; k++) {
-                xre = a[2 * (i * n + k)];
-                xim = a[2 * (i * n + k) + 1];
-                yre = a[2 * (k * n + j)];
-                yim = a[2 * (k * n + j) + 1];
-                sum_re -= xre * yre - xim * yim;
-                sum_im -= xim * yre + xre * yim;
-                STATE(2);
+        a[2 * (j * n + j)] = tmp_re = tiny;
+        a[2 * (j * n + j) + 1] = tmp_im = 0;
+    }
+    tmp = dat->det_re * tmp_re - dat->det_im * tmp_im;
+    dat->det_im = dat->det_im * tmp_re + dat->det_re * tmp_im;
+    dat->det_re = tmp;
+    if (j != n - 1) {
+        tmp = hypot(tmp_re, tmp_im);
+        s_re = tmp_re / tmp / tmp;
+        s_im = -tmp_im / tmp / tmp;
+        phloat *u = a + 2 * j * n;
+        for (i = j + 1; i < n; i++) {
+            phloat *row = a + 2 * i * n;
+            tmp_re = row[2 * j];
+            tmp_im = row[2 * j + 1];
+            phloat xre = tmp_re * s_re - tmp_im * s_im;
+            phloat xim = tmp_im * s_re + tmp_re * s_im;
+            row[2 * j] = xre;
+            row[2 * j + 1] = xim;
+            for (k = j + 1; k < j1; k++) {
+                phloat yre = u[2 * k];
+                phloat yim = u[2 * k + 1];
+                row[2 * k] -= xre * yre - xim * yim;
+                row[2 * k + 1] -= xim * yre + xre * yim;
             }
-            a[2 * (i * n + j)] = sum_re;
-            a[2 * (i * n + j) + 1] = sum_im;
         }
+    }
+    return ERR_NONE;
+}
 
-        max = 0;
-        imax = j;
-        for (i = j; i < n; i++) {
-            sum_re = a[2 * (i * n + j)];
-            sum_im = a[2 * (i * n + j) + 1];
-            for (k = 0; k < j; k++) {
-                xre = a[2 * (i * n + k)];
-                xim = a[2 * (i * n + k) + 1];
-                yre = a[2 * (k * n + j)];
-                yim = a[2 * (k * n + j) + 1];
-                sum_re -= xre * yre - xim * yim;
-                sum_im -= xim * yre + xre * yim;
-                STATE(3);
-            }
-            a[2 * (i * n + j)] = sum_re;
-            a[2 * (i * n + j) + 1] = sum_im;
-            if (scale[i] == 0) {
-                imax = i;
+/* See lu_r_subtract() */
+static void lu_c_subtract(phloat *a, int4 n, phloat *row, int4 k, int4 count,
+                          int4 j1) {
+    for (; count > 0; k++, count--) {
+        phloat xre = row[2 * k];
+        phloat xim = row[2 * k + 1];
+        phloat *u = a + 2 * k * n;
+        for (int4 c = j1; c < n; c++) {
+            phloat yre = u[2 * c];
+            phloat yim = u[2 * c + 1];
+            row[2 * c] -= xre * yre - xim * yim;
+            row[2 * c + 1] -= xim * yre + xre * yim;
+        }
+    }
+}
+
+/* See lu_r_update() */
+static void lu_c_update(void *arg, int part, int4 begin, int4 end) {
+    lu_c_data_struct *dat = (lu_c_data_struct *) arg;
+    phloat *a = dat->a->array->data;
+    int4 n = dat->a->rows;
+    int4 j0 = dat->j0, j1 = dat->j1;
+    for (int4 i = j1 + begin; i < j1 + end; i++)
+        lu_c_subtract(a, n, a + 2 * i * n, j0, j1 - j0, j1);
+}
+
+/* See lu_r_step() */
+static int lu_c_step(lu_c_data_struct *dat, int4 *count) {
+    phloat *a = dat->a->array->data;
+    int4 n = dat->a->rows;
+    int4 step = dat->step;
+    int4 j0 = dat->j0, j1 = dat->j1;
+    int err;
+
+    switch (dat->state) {
+        case 0: {
+            if (step == n) {
+                dat->j0 = 0;
+                dat->j1 = dat->bs < n ? dat->bs : n;
+                dat->state = 1;
+                dat->step = 0;
                 break;
             }
-            tmp = hypot(sum_re, sum_im) / scale[i];
-            if (tmp > max) {
-                imax = i;
-                max = tmp;
+            phloat max = 0;
+            for (int4 c = 0; c < n; c++) {
+                phloat tmp = hypot(a[2 * (step * n + c)],
+                                   a[2 * (step * n + c) + 1]);
+                if (tmp > max)
+                    max = tmp;
             }
+            dat->scale[step] = max;
+            *count += n;
+            dat->step++;
+            break;
         }
-
-        if (j != imax) {
-            for (k = 0; k < n; k++) {
-                tmp = a[2 * (imax * n + k)];
-                a[2 * (imax * n + k)] = a[2 * (j * n + k)];
-                a[2 * (j * n + k)] = tmp;
-                tmp = a[2 * (imax * n + k) + 1];
-                a[2 * (imax * n + k) + 1] = a[2 * (j * n + k) + 1];
-                a[2 * (j * n + k) + 1] = tmp;
-                STATE(4);
+        case 1: {
+            if (step == j1) {
+                dat->state = 2;
+                dat->step = j0;
+                break;
             }
-            dat->det_re = -dat->det_re;
-            dat->det_im = -dat->det_im;
-            scale[imax] = scale[j];
-        }
-
-        perm[j] = imax;
-        tmp_re = a[2 * (j * n + j)];
-        tmp_im = a[2 * (j * n + j) + 1];
-        if (tmp_re == 0 && tmp_im == 0) {
-            if (core_settings.matrix_singularmatrix) {
-                free(scale);
-                err = dat->completion(ERR_NONE, dat->a, perm, 0, 0);
-                free(dat);
+            if ((err = lu_c_column(dat, step)) != ERR_NONE)
                 return err;
-            } else {
-                /* For a zero pivot, substitute a small positive number.
-                 * I use a number that's about 10^-20 times the size of
-                 * the maximum of the original column, with a minimum of
-                 * 10^20 / POS_HUGE_PHLOAT.
-                 */
-                if (scale[j] == 0)
-                    tiny = tiniest;
-                else {
-                    tiny = pow(10, floor(log10(scale[j])) - 20);
-                    if (tiny < tiniest)
-                        tiny = tiniest;
-                }
-                a[2 * (j * n + j)] = tmp_re = tiny;
-                a[2 * (j * n + j) + 1] = tmp_im = 0;
+            *count += (n - step) * (j1 - step);
+            dat->step++;
+            break;
+        }
+        case 2: {
+            if (step == j1) {
+                dat->state = 3;
+                break;
             }
+            lu_c_subtract(a, n, a + 2 * step * n, j0, step - j0, j1);
+            *count += (step - j0 + 1) * (n - j1);
+            dat->step++;
+            break;
         }
-        tmp = dat->det_re * tmp_re - dat->det_im * tmp_im;
-        dat->det_im = dat->det_im * tmp_re + dat->det_re * tmp_im;
-        dat->det_re = tmp;
-        if (j != n - 1) {
-            tmp = hypot(tmp_re, tmp_im);
-            s_re = tmp_re / tmp / tmp;
-            s_im = -tmp_im / tmp / tmp;
-            for (i = j + 1; i < n; i++) {
-                tmp_re = a[2 * (i * n + j)];
-                tmp_im = a[2 * (i * n + j) + 1];
-                a[2 * (i * n + j)] = tmp_re * s_re - tmp_im * s_im;
-                a[2 * (i * n + j) + 1] = tmp_im * s_re + tmp_re * s_im;
-                STATE(5);
+        case 3: {
+            if (step == n) {
+                if (j1 == n)
+                    return ERR_NONE;
+                dat->j0 = j1;
+                dat->j1 = n - j1 > dat->bs ? j1 + dat->bs : n;
+                dat->state = 1;
+                dat->step = j1;
+                break;
             }
+            lu_c_update(dat, 0, step - j1, step - j1 + 1);
+            *count += (j1 - j0) * (n - j1);
+            dat->step++;
+            break;
         }
     }
+    return ERR_INTERRUPTIBLE;
+}
 
-    free(scale);
-    err = dat->completion(ERR_NONE, dat->a, perm, dat->det_re, dat->det_im);
+static int lu_c_finish(lu_c_data_struct *dat, int error) {
+    free(dat->scale);
+    int err;
+    if (error == ERR_NONE)
+        err = dat->completion(ERR_NONE, dat->a, dat->perm,
+                              dat->det_re, dat->det_im);
+    else if (error == ERR_SINGULAR_MATRIX)
+        // Reported as a zero determinant
+        err = dat->completion(ERR_NONE, dat->a, dat->perm, 0, 0);
+    else
+        err = dat->completion(error, dat->a, dat->perm, 0, 0);
     free(dat);
     return err;
+}
 
-    suspend:
-    dat->i = i;
-    dat->imax = imax;
-    dat->j = j;
-    dat->k = k;
-    dat->max = max;
-    dat->tmp = tmp;
-    dat->tmp_re = tmp_re;
-    dat->tmp_im = tmp_im;
-    dat->sum_re = sum_re;
-    dat->sum_im = sum_im;
-    dat->s_re = s_re;
-    dat->s_im = s_im;
-    return ERR_INTERRUPTIBLE;
+static int lu_decomp_c_worker(bool interrupted) {
+    lu_c_data_struct *dat = lu_c_data;
+    if (interrupted)
+        return lu_c_finish(dat, ERR_INTERRUPTED);
+    int4 count = 0;
+    int err;
+    do
+        err = lu_c_step(dat, &count);
+    while (err == ERR_INTERRUPTIBLE && count < 1000);
+    if (err == ERR_INTERRUPTIBLE)
+        return err;
+    return lu_c_finish(dat, err);
+}
+
+static void lu_c_job(void *arg) {
+    lu_c_data_struct *dat = (lu_c_data_struct *) arg;
+    int4 n = dat->a->rows;
+    int4 count = 0;
+    int err;
+    do {
+        if (linalg_job_cancelled())
+            return;
+        if (dat->state == 3 && dat->step == dat->j1) {
+            linalg_parallel(n - dat->j1, dat->threads, lu_c_update, dat);
+            dat->step = n;
+        }
+        err = lu_c_step(dat, &count);
+    } while (err == ERR_INTERRUPTIBLE);
+    if (err != ERR_NONE)
+        linalg_job_error(err);
+}
+
+static int lu_decomp_c_job_worker(bool interrupted) {
+    lu_c_data_struct *dat = lu_c_data;
+    int err;
+    if (interrupted) {
+        linalg_cancel_job();
+        err = ERR_INTERRUPTED;
+    } else if (!linalg_job_done(&err))
+        return ERR_INTERRUPTIBLE;
+    return lu_c_finish(dat, err);
+}
+
+
+/**************************************/
+/***** Cache of LU decompositions *****/
+/**************************************/
+
+/* The decompositions of the last few matrices that were divided by, inverted,
+ * or whose determinants were taken, so doing that again with the same matrix
+ * can go straight to back-substitution. Entries are found by the identity of
+ * the matrix's data array. Each entry holds a reference to that array, so it
+ * is shared, and any change to the matrix will copy it first; the array in the
+ * entry never changes. The factors are kept the same way, as a reference to
+ * the decomposed matrix, which back-substitution doesn't change.
+ * A decomposition that succeeded with the 'singular matrix' error on is also
+ * good with it off, but not the other way around, since with it off, zero
+ * pivots are replaced with tiny numbers.
+ */
+
+#define LU_CACHE_ENTRIES 4
+// Total size of the cached matrices, in phloats, counting both the originals
+// and the factors. Larger decompositions aren't cached.
+#define LU_CACHE_MAX_SIZE 1000000
+
+struct lu_cache_entry {
+    vartype *src;
+    vartype *lu;
+    int4 *perm;
+    phloat det_re, det_im;
+    bool singular_error;
+    int4 size;
+};
+
+// Most recently used first
+static lu_cache_entry lu_cache[LU_CACHE_ENTRIES];
+static int lu_cache_count = 0;
+static int4 lu_cache_size = 0;
+
+static bool same_matrix(const vartype *a, const vartype *b) {
+    if (a->type != b->type)
+        return false;
+    if (a->type == TYPE_REALMATRIX) {
+        vartype_realmatrix *ra = (vartype_realmatrix *) a;
+        vartype_realmatrix *rb = (vartype_realmatrix *) b;
+        return ra->array == rb->array && ra->rows == rb->rows
+                                      && ra->columns == rb->columns;
+    } else {
+        vartype_complexmatrix *ca = (vartype_complexmatrix *) a;
+        vartype_complexmatrix *cb = (vartype_complexmatrix *) b;
+        return ca->array == cb->array && ca->rows == cb->rows
+                                      && ca->columns == cb->columns;
+    }
+}
+
+static void lu_cache_remove(int i) {
+    lu_cache_entry *e = lu_cache + i;
+    free_vartype(e->src);
+    free_vartype(e->lu);
+    free(e->perm);
+    lu_cache_size -= e->size;
+    lu_cache_count--;
+    memmove(e, e + 1, (lu_cache_count - i) * sizeof(lu_cache_entry));
+}
+
+void clear_lu_cache() {
+    while (lu_cache_count > 0)
+        lu_cache_remove(lu_cache_count - 1);
+}
+
+/* Returns the entry for src, moved to the front, or NULL */
+static lu_cache_entry *lu_cache_find(const vartype *src) {
+    for (int i = 0; i < lu_cache_count; i++) {
+        lu_cache_entry *e = lu_cache + i;
+        if (!same_matrix(e->src, src))
+            continue;
+        if (!e->singular_error && core_settings.matrix_singularmatrix)
+            return NULL;
+        lu_cache_entry tmp = *e;
+        memmove(lu_cache + 1, lu_cache, i * sizeof(lu_cache_entry));
+        lu_cache[0] = tmp;
+        return lu_cache;
+    }
+    return NULL;
+}
+
+static void lu_cache_add(const vartype *src, vartype *lu, int4 *perm,
+                         phloat det_re, phloat det_im, bool singular_error) {
+    int4 n = ((vartype_realmatrix *) lu)->rows;
+    int4 size = 2 * n * n * (lu->type == TYPE_COMPLEXMATRIX ? 2 : 1);
+    if (size > LU_CACHE_MAX_SIZE)
+        return;
+    for (int i = 0; i < lu_cache_count; i++)
+        if (same_matrix(lu_cache[i].src, src)) {
+            lu_cache_remove(i);
+            break;
+        }
+    while (lu_cache_count == LU_CACHE_ENTRIES
+            || lu_cache_count > 0 && lu_cache_size + size > LU_CACHE_MAX_SIZE)
+        lu_cache_remove(lu_cache_count - 1);
+
+    lu_cache_entry e;
+    e.src = dup_vartype(src);
+    e.lu = dup_vartype(lu);
+    e.perm = (int4 *) malloc(n * sizeof(int4));
+    if (e.src == NULL || e.lu == NULL || e.perm == NULL) {
+        free_vartype(e.src);
+        free_vartype(e.lu);
+        free(e.perm);
+        return;
+    }
+    memcpy(e.perm, perm, n * sizeof(int4));
+    e.det_re = det_re;
+    e.det_im = det_im;
+    e.singular_error = singular_error;
+    e.size = size;
+    memmove(lu_cache + 1, lu_cache, lu_cache_count * sizeof(lu_cache_entry));
+    lu_cache[0] = e;
+    lu_cache_count++;
+    lu_cache_size += size;
+}
+
+static vartype *lu_cached_src;
+static bool lu_cached_singular_error;
+static int (*lu_cached_r_completion)(int, vartype_realmatrix *, int4 *, phloat);
+static int (*lu_cached_c_completion)(int, vartype_complexmatrix *, int4 *,
+                                     phloat, phloat);
+
+static int lu_cached_r_done(int error, vartype_realmatrix *a, int4 *perm,
+                            phloat det) {
+    if (error == ERR_NONE && lu_cached_src != NULL)
+        lu_cache_add(lu_cached_src, (vartype *) a, perm, det, 0,
+                     lu_cached_singular_error);
+    free_vartype(lu_cached_src);
+    lu_cached_src = NULL;
+    return lu_cached_r_completion(error, a, perm, det);
+}
+
+int lu_decomp_r_cached(const vartype *src, vartype_realmatrix *a, int4 *perm,
+                int (*completion)(int, vartype_realmatrix *, int4 *, phloat)) {
+    lu_cache_entry *e = lu_cache_find(src);
+    if (e != NULL) {
+        int4 n = a->rows;
+        memcpy(a->array->data, ((vartype_realmatrix *) e->lu)->array->data,
+               n * n * sizeof(phloat));
+        memcpy(perm, e->perm, n * sizeof(int4));
+        return completion(ERR_NONE, a, perm, e->det_re);
+    }
+    lu_cached_src = dup_vartype(src);
+    lu_cached_singular_error = core_settings.matrix_singularmatrix;
+    lu_cached_r_completion = completion;
+    return lu_decomp_r(a, perm, lu_cached_r_done);
+}
+
+static int lu_cached_c_done(int error, vartype_complexmatrix *a, int4 *perm,
+                            phloat det_re, phloat det_im) {
+    /* With the 'singular matrix' error on, lu_decomp_c() reports a singular
+     * matrix as a zero determinant, without finishing the decomposition.
+     */
+    if (error == ERR_NONE && lu_cached_src != NULL
+            && !(lu_cached_singular_error && det_re == 0 && det_im == 0))
+        lu_cache_add(lu_cached_src, (vartype *) a, perm, det_re, det_im,
+                     lu_cached_singular_error);
+    free_vartype(lu_cached_src);
+    lu_cached_src = NULL;
+    return lu_cached_c_completion(error, a, perm, det_re, det_im);
+}
+
+int lu_decomp_c_cached(const vartype *src, vartype_complexmatrix *a,
+                int4 *perm, int (*completion)(int, vartype_complexmatrix *,
+                                          int4 *, phloat, phloat)) {
+    lu_cache_entry *e = lu_cache_find(src);
+    if (e != NULL) {
+        int4 n = a->rows;
+        memcpy(a->array->data, ((vartype_complexmatrix *) e->lu)->array->data,
+               2 * n * n * sizeof(phloat));
+        memcpy(perm, e->perm, n * sizeof(int4));
+        return completion(ERR_NONE, a, perm, e->det_re, e->det_im);
+    }
+    lu_cached_src = dup_vartype(src);
+    lu_cached_singular_error = core_settings.matrix_singularmatrix;
+    lu_cached_c_completion = completion;
+    return lu_decomp_c(a, perm, lu_cached_c_done);
 }
 
 
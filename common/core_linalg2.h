@@ -20,6 +20,37 @@
 
 #include "core_variables.h"
 
+/* Multithreading, for large matrix operations.
+ *
+ * linalg_threads() returns the number of threads to use for an operation
+ * that takes the given number of multiply-adds; 1 means it isn't worth it,
+ * or that multithreading is turned off (see core_settings.matrix_threads).
+ * A multithreaded operation runs as a background job, started with
+ * linalg_start_job(), which returns false if the job's thread couldn't be
+ * created; the operation should then be done on the calling thread instead.
+ * Its interruptible worker then calls linalg_job_done(),
+ * which waits a few milliseconds for the job to finish, and returns false if
+ * it hasn't yet; or, when interrupted, linalg_cancel_job(), which waits until
+ * the job has noticed linalg_job_cancelled(). The job reports errors with
+ * linalg_job_error(); linalg_job_done() returns the first one, or ERR_NONE,
+ * in *error.
+ * Within the job, linalg_parallel() splits [0, n) into 'parts' ranges of
+ * nearly equal size, runs f on each, using a pool of worker threads, and
+ * returns when all of them are done.
+ * The job and the parts must not touch anything but the matrices they are
+ * working on; in particular, nothing that the calling thread may be using
+ * while it waits.
+ */
+int linalg_threads(double work);
+bool linalg_start_job(void (*job)(void *arg), void *arg);
+bool linalg_job_done(int *error);
+void linalg_cancel_job();
+bool linalg_job_cancelled();
+void linalg_job_error(int error);
+void linalg_parallel(int4 n, int parts,
+                     void (*f)(void *arg, int part, int4 begin, int4 end),
+                     void *arg);
+
 int lu_decomp_r(vartype_realmatrix *a, int4 *perm,
                        int (*completion)(int, vartype_realmatrix *,
                                           int4 *, phloat));
@@ -28,6 +59,22 @@ int lu_decomp_c(vartype_complexmatrix *a, int4 *perm,
                        int (*completion)(int, vartype_complexmatrix *,
                                           int4 *, phloat, phloat));
 
+/* Like lu_decomp_r() and lu_decomp_c(), where a is a copy of src, but if
+ * the decomposition of src is in the cache, it is copied into a and perm,
+ * and the completion is called right away; otherwise, the decomposition is
+ * added to the cache when done. clear_lu_cache() empties the cache.
+ */
+int lu_decomp_r_cached(const vartype *src, vartype_realmatrix *a, int4 *perm,
+                       int (*completion)(int, vartype_realmatrix *,
+                                          int4 *, phloat));
+
+int lu_decomp_c_cached(const vartype *src, vartype_complexmatrix *a,
+                       int4 *perm,
+                       int (*completion)(int, vartype_complexmatrix *,
+                                          int4 *, phloat, phloat));
+
+void clear_lu_cache();
+
 int lu_backsubst_rr(vartype_realmatrix *a,
                             int4 *perm,
                             vartype_realmatrix *b,
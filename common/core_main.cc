@@ -20,6 +20,7 @@
 #include <string.h>
 #include <stdarg.h>
 #include <errno.h>
+#include <chrono>
 
 #include "core_main.h"
 #include "core_commands2.h"
@@ -30,7 +31,10 @@
 #include "core_equations.h"
 #include "core_helpers.h"
 #include "core_keydown.h"
+#include "core_linalg1.h"
+#include "core_linalg2.h"
 #include "core_math1.h"
+#include "core_parser.h"
 #include "core_sto_rcl.h"
 #include "core_tables.h"
 #include "core_variables.h"
@@ -69,7 +73,7 @@ int repeating_key;
 
 static int4 oldpc;
 
-core_settings_struct core_settings;
+core_settings_struct core_settings = { false, false, true, 10, 1, 64, 0 };
 
 void core_init(int read_saved_state, int4 version, const char *state_file_name, int offset) {
 
@@ -165,11 +169,10 @@ void core_cleanup() {
     for (int i = 0; i <= sp; i++)
         free_vartype(stack[i]);
     sp = -1;
-    free(stack);
-    stack = NULL;
-    stack_capacity = 0;
+    free_stack();
     free_vartype(lastx);
     lastx = NULL;
+    clear_lu_cache();
     clean_vartype_pools();
 }
 
@@ -4599,6 +4602,10 @@ void core_paste(const char *buf) {
                 rm->columns = cols;
                 rm->array->data = data;
                 rm->array->is_string = is_string;
+                rm->array->string_count = 0;
+                for (int i = 0; i < n; i++)
+                    if (is_string[i] != 0)
+                        rm->array->string_count++;
                 rm->array->refcount = 1;
                 v = (vartype *) rm;
             } else {
@@ -4644,6 +4651,46 @@ void core_paste(const char *buf) {
     redisplay();
 }
 
+bool core_run_label(const char *name, bool *found) {
+    arg_struct arg;
+    arg.type = ARGTYPE_STR;
+    arg.length = ascii2hp(arg.val.text, 7, name);
+    pgm_index prgm;
+    int4 pc;
+    *found = find_global_label(&arg, &prgm, &pc) != 0;
+    if (!*found) {
+        display_error(ERR_LABEL_NOT_FOUND, false);
+        redisplay();
+        return false;
+    }
+    pending_command = CMD_XEQ;
+    pending_command_arg = arg;
+    return core_keyup();
+}
+
+char *core_copy_stack() {
+    textbuf tb;
+    tb.buf = NULL;
+    tb.size = 0;
+    tb.capacity = 0;
+    tb.fail = false;
+
+    char buf[100];
+    char abuf[500];
+    for (int i = 0; i <= sp; i++) {
+        int len = vartype2string(stack[i], buf, 100);
+        int alen = hp2ascii(abuf, buf, len);
+        tb_write(&tb, abuf, alen);
+        tb_write(&tb, "\n", 1);
+    }
+    tb_write_null(&tb);
+    if (tb.fail) {
+        free(tb.buf);
+        return NULL;
+    }
+    return tb.buf;
+}
+
 void set_alpha_entry(bool state) {
     mode_alpha_entry = state;
 }
@@ -4658,7 +4705,8 @@ void set_running(bool state) {
         input_length = 0;
         mode_goose = -2;
         prgm_highlight_row = 1;
-    }
+    } else
+        flush_catalog();
 }
 
 bool program_running() {
@@ -4755,9 +4803,352 @@ void do_interactive(int command) {
     }
 }
 
+#define MAX_RUN_SLICE_SIZE 1048576
+/* Within a slice, the clock is checked every this many instructions, and
+ * the slice ends early once it has taken longer than run_slice_ms.
+ * Otherwise, a program that suddenly slows down, e.g. by starting on large
+ * matrix operations after a long stretch of simple arithmetic, would keep
+ * the UI frozen for the entire oversized slice.
+ */
+#define RUN_SLICE_CHECK_INTERVAL 64
+
+/* Program profiler
+ *
+ * While profiling is on, continue_running() measures the wall time spent in
+ * each program line, and adds it to two tables: one keyed by the line itself,
+ * and one keyed by the global label that the line falls under, where it is
+ * also added to every global label that has a return address on the RTN
+ * stack, giving the time spent in that label including its subroutines.
+ * Lines are identified by their unified program index and pc, so the report
+ * only makes sense if the programs aren't edited while profiling. Lines that
+ * start interruptible functions are only charged for their first slice.
+ * If the tables can't grow, profiling stops, and the report says so.
+ */
+
+struct profile_entry {
+    int4 prgm; // unified program index; -2 means the slot is unused
+    int4 pc;   // for label entries: the pc of the LBL, or -1 if none
+    uint4 stamp;
+    int4 count;
+    int8 self_time;
+    int8 total_time;
+};
+
+struct profile_table {
+    int size;
+    int count;
+    profile_entry *entries;
+};
+
+static bool profiling = false;
+static bool profile_out_of_memory = false;
+static uint4 profile_stamp;
+static int8 profile_elapsed;
+static profile_table profile_lines = { 0, 0, NULL };
+static profile_table profile_labels = { 0, 0, NULL };
+
+#define PROFILE_MAX_DEPTH 256
+
+static int8 profile_clock() {
+    return std::chrono::duration_cast<std::chrono::nanoseconds>(
+            std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+static void profile_clear(profile_table *t) {
+    free(t->entries);
+    t->size = 0;
+    t->count = 0;
+    t->entries = NULL;
+}
+
+/* Returns the entry for (prgm, pc), adding it if necessary, or NULL if the
+ * table needs to grow and there isn't enough memory.
+ */
+static profile_entry *profile_find(profile_table *t, int4 prgm, int4 pc) {
+    if (t->count * 2 >= t->size) {
+        int oldsize = t->size;
+        int newsize = oldsize == 0 ? 256 : oldsize * 2;
+        profile_entry *entries = (profile_entry *) malloc(newsize * sizeof(profile_entry));
+        if (entries == NULL)
+            return NULL;
+        profile_entry *old = t->entries;
+        t->size = newsize;
+        t->entries = entries;
+        for (int i = 0; i < t->size; i++)
+            t->entries[i].prgm = -2;
+        t->count = 0;
+        for (int i = 0; i < oldsize; i++)
+            if (old[i].prgm != -2) {
+                profile_entry *e = profile_find(t, old[i].prgm, old[i].pc);
+                *e = old[i];
+            }
+        free(old);
+    }
+    uint4 h = ((uint4) prgm * 2654435761u) ^ ((uint4) pc * 40503u);
+    int i = h & (t->size - 1);
+    while (true) {
+        profile_entry *e = t->entries + i;
+        if (e->prgm == prgm && e->pc == pc)
+            return e;
+        if (e->prgm == -2) {
+            e->prgm = prgm;
+            e->pc = pc;
+            e->stamp = 0;
+            e->count = 0;
+            e->self_time = 0;
+            e->total_time = 0;
+            t->count++;
+            return e;
+        }
+        i = (i + 1) & (t->size - 1);
+    }
+}
+
+static profile_entry *profile_label(int4 prgm, int4 pc) {
+    int i = find_enclosing_label(prgm, pc);
+    return profile_find(&profile_labels, prgm, i == -1 ? -1 : labels[i].pc);
+}
+
+static void profile_stop_out_of_memory() {
+    profiling = false;
+    profile_out_of_memory = true;
+}
+
+static void profile_line(int4 prgm, int4 pc, int8 t) {
+    profile_entry *e = profile_find(&profile_lines, prgm, pc);
+    if (e == NULL) {
+        profile_stop_out_of_memory();
+        return;
+    }
+    e->count++;
+    e->self_time += t;
+    profile_elapsed += t;
+    uint4 stamp = ++profile_stamp;
+    e = profile_label(prgm, pc);
+    if (e == NULL) {
+        profile_stop_out_of_memory();
+        return;
+    }
+    e->count++;
+    e->self_time += t;
+    e->total_time += t;
+    e->stamp = stamp;
+    int4 stack_prgms[PROFILE_MAX_DEPTH];
+    int4 stack_pcs[PROFILE_MAX_DEPTH];
+    int n = get_rtn_addrs(stack_prgms, stack_pcs, PROFILE_MAX_DEPTH);
+    for (int i = 0; i < n; i++) {
+        e = profile_label(stack_prgms[i], stack_pcs[i]);
+        if (e == NULL) {
+            profile_stop_out_of_memory();
+            return;
+        }
+        if (e->stamp != stamp) {
+            // Count recursive calls only once
+            e->total_time += t;
+            e->stamp = stamp;
+        }
+    }
+}
+
+void core_profile(bool on) {
+    if (on) {
+        profile_clear(&profile_lines);
+        profile_clear(&profile_labels);
+        profile_stamp = 0;
+        profile_elapsed = 0;
+        profile_out_of_memory = false;
+        clear_equation_code_stats();
+    }
+    profiling = on;
+}
+
+static int profile_compare(const void *a, const void *b) {
+    const profile_entry *ea = *(const profile_entry **) a;
+    const profile_entry *eb = *(const profile_entry **) b;
+    int8 ta = ea->total_time > ea->self_time ? ea->total_time : ea->self_time;
+    int8 tb = eb->total_time > eb->self_time ? eb->total_time : eb->self_time;
+    return ta < tb ? 1 : ta > tb ? -1 : 0;
+}
+
+static profile_entry **profile_sorted(profile_table *t) {
+    profile_entry **list = (profile_entry **) malloc((t->count + 1) * sizeof(profile_entry *));
+    if (list == NULL)
+        return NULL;
+    int n = 0;
+    for (int i = 0; i < t->size; i++)
+        if (t->entries[i].prgm != -2)
+            list[n++] = t->entries + i;
+    qsort(list, n, sizeof(profile_entry *), profile_compare);
+    return list;
+}
+
+static int profile_label_name(char *buf, int buflen, int4 prgm, int4 pc) {
+    /* Writes the name of the global label that the line at (prgm, pc) falls
+     * under, in ASCII, or a description of the program or equation if there
+     * is no such label.
+     */
+    if ((prgm & 1) != 0) {
+        int idx = (prgm >> 1) + prgms_count;
+        if (idx < prgms_and_eqns_count && prgms[idx].eq_data != NULL) {
+            equation_data *eqd = prgms[idx].eq_data;
+            char tbuf[100];
+            int len = eqd->length > 16 ? 16 : eqd->length;
+            len = hp2ascii(tbuf, eqd->text, len);
+            return snprintf(buf, buflen, "'%.*s%s'", len, tbuf, eqd->length > 16 ? "..." : "");
+        }
+        return snprintf(buf, buflen, "(equation)");
+    }
+    int i = find_enclosing_label(prgm, pc);
+    if (i == -1)
+        return snprintf(buf, buflen, "(program %d)", (prgm >> 1) + 1);
+    char tbuf[40];
+    int len = hp2ascii(tbuf, labels[i].name, labels[i].length);
+    return snprintf(buf, buflen, "\"%.*s\"", len, tbuf);
+}
+
+static int profile_line_text(char *buf, int buflen, int4 prgm, int4 pc) {
+    /* Writes the line number and listing of a program line, in ASCII */
+    if ((prgm & 1) != 0 || (prgm >> 1) >= prgms_count
+            || pc >= prgms[prgm >> 1].size)
+        return snprintf(buf, buflen, "pc %d", pc);
+    pgm_index saved_prgm = current_prgm;
+    current_prgm.set_prgm(prgm >> 1);
+    int4 line = pc2line(pc);
+    int4 pc2 = pc;
+    int cmd;
+    arg_struct arg;
+    const char *orig_num;
+    get_next_command(&pc2, &cmd, &arg, 0, &orig_num);
+    current_prgm = saved_prgm;
+    char hpbuf[100];
+    int hplen;
+    if (cmd == CMD_NUMBER) {
+        const char *num = orig_num != NULL ? orig_num : phloat2program(arg.val_d);
+        hplen = (int) strlen(num);
+        if (hplen > 100)
+            hplen = 100;
+        memcpy(hpbuf, num, hplen);
+    } else
+        hplen = command2buf(hpbuf, 100, cmd, &arg);
+    char tbuf[500];
+    int len = hp2ascii(tbuf, hpbuf, hplen);
+    return snprintf(buf, buflen, "%04d %.*s", line, len, tbuf);
+}
+
+void core_profile_report(const char *file_name) {
+    profile_entry **lbls = profile_sorted(&profile_labels);
+    profile_entry **lines = profile_sorted(&profile_lines);
+    double elapsed = profile_elapsed / 1e9;
+    char name[100], text[100];
+    int4 eqn_generated, eqn_stored;
+    get_equation_code_stats(&eqn_generated, &eqn_stored);
+    if (lbls == NULL || lines == NULL) {
+        shell_message("Not enough memory for the profile report");
+        goto done;
+    }
+    if (file_name != NULL) {
+        FILE *f = my_fopen(file_name, "w");
+        if (f == NULL) {
+            char msg[1024];
+            int err = errno;
+            snprintf(msg, 1024, "Could not open \"%s\" for writing: %s (%d)", file_name, strerror(err), err);
+            shell_message(msg);
+            goto done;
+        }
+        fprintf(f, "Program profile: %u lines, %.6f s\n\n", profile_stamp, elapsed);
+        if (profile_out_of_memory)
+            fprintf(f, "Profiling stopped early: not enough memory\n\n");
+        if (eqn_generated > 0)
+            fprintf(f, "Equations compiled: %d lines generated, %d after optimization\n\n", eqn_generated, eqn_stored);
+        fprintf(f, "Global labels, by time including subroutines:\n");
+        fprintf(f, "     total s  total%%      self s   self%%       lines  label\n");
+        for (int i = 0; i < profile_labels.count; i++) {
+            profile_entry *e = lbls[i];
+            profile_label_name(name, 100, e->prgm, e->pc);
+            fprintf(f, "%12.6f %6.2f%% %11.6f %6.2f%% %11d  %s\n",
+                    e->total_time / 1e9, elapsed == 0 ? 0 : e->total_time / 1e7 / elapsed,
+                    e->self_time / 1e9, elapsed == 0 ? 0 : e->self_time / 1e7 / elapsed,
+                    e->count, name);
+        }
+        fprintf(f, "\nProgram lines, by time:\n");
+        fprintf(f, "      time s    time%%       count  label       line\n");
+        for (int i = 0; i < profile_lines.count; i++) {
+            profile_entry *e = lines[i];
+            profile_label_name(name, 100, e->prgm, e->pc);
+            profile_line_text(text, 100, e->prgm, e->pc);
+            fprintf(f, "%12.6f %7.2f%% %11d  %-10s  %s\n",
+                    e->self_time / 1e9, elapsed == 0 ? 0 : e->self_time / 1e7 / elapsed,
+                    e->count, name, text);
+        }
+        fclose(f);
+    } else {
+        /* The printer is only 24 characters wide, so we just print the
+         * top ten of each list, with the times, in seconds, right-justified
+         */
+        char hpbuf[100];
+        int n;
+        print_text("PROFILE", 7, true);
+        n = snprintf(text, 100, "%.3f", elapsed);
+        print_right("TOTAL", 5, text, n);
+        if (profile_out_of_memory)
+            print_text("STOPPED: NO MEMORY", 18, true);
+        if (eqn_generated > 0) {
+            n = snprintf(text, 100, "%d>%d", eqn_generated, eqn_stored);
+            print_right("EQN LINES", 9, text, n);
+        }
+        print_text("LABELS:", 7, true);
+        for (int i = 0; i < profile_labels.count && i < 10; i++) {
+            profile_entry *e = lbls[i];
+            int len = profile_label_name(name, 100, e->prgm, e->pc);
+            len = ascii2hp(hpbuf, 100, name, len);
+            n = snprintf(text, 100, "%.3f", e->total_time / 1e9);
+            print_right(hpbuf, len, text, n);
+        }
+        print_text("LINES:", 6, true);
+        for (int i = 0; i < profile_lines.count && i < 10; i++) {
+            profile_entry *e = lines[i];
+            int len = profile_line_text(name, 100, e->prgm, e->pc);
+            len = ascii2hp(hpbuf, 100, name, len);
+            n = snprintf(text, 100, "%.3f", e->self_time / 1e9);
+            print_right(hpbuf, len, text, n);
+        }
+    }
+    done:
+    free(lbls);
+    free(lines);
+}
+
+int4 core_tune_matrix_block_size() {
+    return linalg_tune_block_size();
+}
+
+static void adjust_run_slice(uint4 elapsed, int4 executed) {
+    int4 target = core_settings.run_slice_ms;
+    int4 n = core_settings.run_slice_size;
+    if (target <= 0)
+        n = 1;
+    else if (elapsed < (uint4) target / 2) {
+        if (n < MAX_RUN_SLICE_SIZE)
+            n *= 2;
+    } else if (elapsed > (uint4) target) {
+        // Shrink to what would have fit in the target time, judging by the
+        // slice that just ran, so that the next one isn't far too long,
+        // too, if the program has slowed down a lot
+        int4 fit = (int4) ((int8) executed * target / elapsed);
+        n /= 2;
+        if (n > fit)
+            n = fit;
+        if (n < 1)
+            n = 1;
+    }
+    core_settings.run_slice_size = n;
+}
+
 static void continue_running() {
     int error;
-    do {
+    int4 budget = core_settings.run_slice_size;
+    uint4 slice_start = shell_milliseconds();
+    while (true) {
         int cmd;
         arg_struct arg;
         oldpc = pc;
@@ -4768,14 +5159,21 @@ static void continue_running() {
             set_running(false);
             return;
         }
-        get_next_command(&pc, &cmd, &arg, 1, NULL);
+        int4 line_prgm = current_prgm.unified();
+        int4 line_pc = pc;
+        get_next_decoded_command(&pc, &cmd, &arg);
         if (flags.f.trace_print && flags.f.printer_exists) {
             if (cmd == CMD_LBL)
                 print_text(NULL, 0, true);
             print_program_line(current_prgm, oldpc);
         }
         mode_disable_stack_lift = false;
-        error = handle(cmd, &arg);
+        if (profiling) {
+            int8 t = profile_clock();
+            error = handle(cmd, &arg);
+            profile_line(line_prgm, line_pc, profile_clock() - t);
+        } else
+            error = handle(cmd, &arg);
         if (mode_pause) {
             shell_request_timeout3(1000);
             return;
@@ -4786,7 +5184,17 @@ static void continue_running() {
             return;
         if (mode_getkey)
             return;
-    } while (!shell_wants_cpu());
+        if (--budget > 0 && budget % RUN_SLICE_CHECK_INTERVAL != 0)
+            continue;
+        uint4 now = shell_milliseconds();
+        if (budget > 0 && now - slice_start <= (uint4) core_settings.run_slice_ms)
+            continue;
+        adjust_run_slice(now - slice_start, core_settings.run_slice_size - budget);
+        if (shell_wants_cpu())
+            return;
+        budget = core_settings.run_slice_size;
+        slice_start = now;
+    }
 }
 
 struct synonym_spec {
@@ -310,6 +310,57 @@ char *core_copy();
  */
 void core_paste(const char *s);
 
+/* core_run_label()
+ *
+ * Starts running the program at the global label 'name', given in ASCII, as
+ * if XEQ "name" had been entered from the keyboard. This is meant for shells
+ * that run programs without user interaction; the calculator should be in
+ * normal mode, not in program mode or alpha or number entry.
+ * If the label does not exist, *found is set to false, and the core reports
+ * Label Not Found. The return value has the same meaning as that of
+ * core_keyup(): if it is true, the shell should keep calling core_keydown()
+ * with key = 0 for as long as that returns true.
+ */
+bool core_run_label(const char *name, bool *found);
+
+/* core_copy_stack()
+ *
+ * Returns a string representation of the entire stack, one level per line,
+ * highest level first and X last, formatted the way they would be shown on
+ * the display. The caller should free the returned text using free(3).
+ */
+char *core_copy_stack();
+
+/* core_profile()
+ *
+ * Turns the program profiler on or off. While it is on, the core counts every
+ * program line it executes, and the wall time spent in it, per line and per
+ * global label. Turning the profiler on discards any previously collected
+ * data.
+ */
+void core_profile(bool on);
+
+/* core_profile_report()
+ *
+ * Writes a report of the data collected by the profiler, sorted by time, to
+ * the file named by file_name. If file_name is NULL, a short summary is
+ * printed instead, using shell_print(). The report also shows how many lines
+ * of equation code were generated while profiling, before and after
+ * optimization.
+ */
+void core_profile_report(const char *file_name);
+
+/* core_tune_matrix_block_size()
+ *
+ * Finds the block size for matrix multiplication that works best on this
+ * machine, by timing multiplications of real matrices with several block
+ * sizes, and without blocking. Stores the result in
+ * core_settings.matrix_block_size, and returns it. This takes a few
+ * seconds, so it's best done on request, and the result saved with the
+ * shell's other settings.
+ */
+int4 core_tune_matrix_block_size();
+
 /* core_settings
  *
  * This is a struct that stores user-configurable core settings. The shell
@@ -320,6 +371,29 @@ struct core_settings_struct {
     bool matrix_singularmatrix;
     bool matrix_outofrange;
     bool auto_repeat;
+    /* Time slicing for running programs: instead of calling
+     * shell_wants_cpu() after every instruction, the core runs
+     * run_slice_size instructions between checks, and adjusts that number
+     * so that each slice takes about run_slice_ms milliseconds; a slice
+     * that takes longer than that is cut short. The shell may change
+     * run_slice_ms; run_slice_size is maintained by the core, and is only
+     * exposed for informational purposes. Setting run_slice_ms to zero
+     * restores the old behavior of checking after every instruction.
+     */
+    int4 run_slice_ms;
+    int4 run_slice_size;
+    /* Matrix multiplication works on blocks of this many rows and columns
+     * at a time, so they stay in the CPU cache; 0 means no blocking. LU
+     * decomposition uses it as the width of its panels, with 0 meaning one
+     * column at a time. The best value depends on the machine;
+     * core_tune_matrix_block_size() measures it, for multiplication.
+     */
+    int4 matrix_block_size;
+    /* Large matrix multiplications and LU decompositions are split among
+     * at most this many threads; 0 means one per processor, and 1 turns
+     * multithreading off.
+     */
+    int4 matrix_threads;
 };
 
 extern core_settings_struct core_settings;
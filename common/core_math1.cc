@@ -364,6 +364,47 @@ int set_solve_eqn(equation_data *eqdata) {
     return ERR_NONE;
 }
 
+/* When SOLVE or INTEG work on an equation that can be evaluated directly
+ * (see evaluate_directly()), call_solve_fn() and call_integ_fn() evaluate it
+ * on the spot, instead of jumping into its generated code, and pass the
+ * result straight back to return_to_solve() or return_to_integ(). Those call
+ * call_solve_fn() or call_integ_fn() again, so to keep this from recursing,
+ * the outermost call runs a loop, and the nested calls just flag that the
+ * next result is ready. Every DIRECT_YIELD_INTERVAL-th evaluation still runs
+ * the generated code, so that the shell gets to handle events, like the user
+ * pressing EXIT, at the usual intervals.
+ */
+#define DIRECT_YIELD_INTERVAL 100
+static bool direct_loop_active = false;
+static bool direct_result_pending = false;
+static int direct_count = 0;
+
+static bool call_fn_directly(vartype *eq, int (*return_fn)(), int *err) {
+    if (++direct_count == DIRECT_YIELD_INTERVAL) {
+        direct_count = 0;
+        return false;
+    }
+    vartype_equation *veq = (vartype_equation *) eq;
+    if (!evaluate_directly(prgms[veq->data.index()].eq_data))
+        return false;
+    if (direct_loop_active) {
+        direct_result_pending = true;
+        *err = ERR_NONE;
+        return true;
+    }
+    direct_loop_active = true;
+    do {
+        direct_result_pending = false;
+        *err = return_fn();
+    } while (direct_result_pending);
+    direct_loop_active = false;
+    return true;
+}
+
+static int return_to_solve_directly() {
+    return return_to_solve(0, false);
+}
+
 static int call_solve_fn(int which, int state) {
     if (solve.active_eq == NULL && solve.active_prgm_length == 0)
         return ERR_NONEXISTENT;
@@ -399,6 +440,8 @@ static int call_solve_fn(int which, int state) {
         }
     } else {
         clean_stack(solve.prev_sp);
+        if (call_fn_directly(solve.active_eq, return_to_solve_directly, &err))
+            return err;
         vartype_equation *eq = (vartype_equation *) solve.active_eq;
         current_prgm = eq->data;
         pc = 0;
@@ -416,6 +459,48 @@ static int call_solve_fn(int which, int state) {
 
 static int start_solve_2(phloat x1, phloat x2, bool after_direct);
 
+/* Newton steps. When the root has been bracketed, and the function is an
+ * equation whose derivative is known (see evaluate_derivative()), the solver
+ * tries a Newton step from the end of the bracket with the smaller residual,
+ * before resorting to Ridders' method. The step is only taken if it lands
+ * strictly inside the bracket; if it doesn't move at all, that end is the
+ * root, as far as the precision of x allows. After a step that didn't at
+ * least halve the residual, one round of Ridders' method is done before
+ * trying again, so the bracket keeps shrinking even where Newton's method
+ * converges slowly.
+ */
+#define NEWTON_NONE 0
+#define NEWTON_STEP 1
+#define NEWTON_CONVERGED 2
+static bool newton_stalled = false;
+
+static int newton_step() {
+    if (newton_stalled) {
+        newton_stalled = false;
+        return NEWTON_NONE;
+    }
+    if (solve.active_eq == NULL)
+        return NEWTON_NONE;
+    vartype *v = recall_var(solve.var_name, solve.var_length);
+    if (v == NULL || v->type != TYPE_REAL)
+        return NEWTON_NONE;
+    bool use_x1 = fabs(solve.fx1) < fabs(solve.fx2);
+    phloat x = use_x1 ? solve.x1 : solve.x2;
+    phloat f = use_x1 ? solve.fx1 : solve.fx2;
+    ((vartype_real *) v)->x = x;
+    phloat slope;
+    equation_data *eqd = prgms[((vartype_equation *) solve.active_eq)->data.index()].eq_data;
+    if (!evaluate_derivative(eqd, solve.var_name, solve.var_length, &slope) || slope == 0)
+        return NEWTON_NONE;
+    phloat x3 = x - f / slope;
+    if (x3 == x)
+        return NEWTON_CONVERGED;
+    if (!(x3 > solve.x1 && x3 < solve.x2))
+        return NEWTON_NONE;
+    solve.x3 = x3;
+    return NEWTON_STEP;
+}
+
 int start_solve(const char *name, int length, vartype *v1, vartype *v2) {
     if (solve_active())
         return ERR_SOLVE_SOLVE;
@@ -512,6 +597,7 @@ static int start_solve_2(phloat x1, phloat x2, bool after_direct) {
     solve.second_f = POS_HUGE_PHLOAT;
     solve.last_disp_time = 0;
     solve.toggle = 1;
+    newton_stalled = false;
     if (!after_direct)
         solve.keep_running = !should_i_stop_at_this_level() && program_running();
     return call_solve_fn(1, 1);
@@ -1076,6 +1162,13 @@ int return_to_solve(int failure, bool stop) {
                 solve.fx1 = f;
             }
             do_ridders:
+            switch (newton_step()) {
+                case NEWTON_STEP:
+                    return call_solve_fn(3, 9);
+                case NEWTON_CONVERGED:
+                    solve.which = -1;
+                    return finish_solve(SOLVE_ROOT);
+            }
             solve.x3 = (solve.x1 + solve.x2) / 2;
             // TODO: The following termination condition should really be
             //
@@ -1095,6 +1188,22 @@ int return_to_solve(int failure, bool stop) {
             } else
                 return call_solve_fn(3, 6);
 
+        case 9: {
+            /* Newton step, evaluated x3 */
+            if (failure)
+                goto do_bisection;
+            phloat newton_prev_f = fabs(solve.fx1) < fabs(solve.fx2) ? solve.fx1 : solve.fx2;
+            if ((f > 0 && solve.fx1 > 0) || (f < 0 && solve.fx1 < 0)) {
+                solve.x1 = solve.x3;
+                solve.fx1 = f;
+            } else {
+                solve.x2 = solve.x3;
+                solve.fx2 = f;
+            }
+            newton_stalled = fabs(f) > fabs(newton_prev_f) / 2;
+            goto do_ridders;
+        }
+
         default:
             return ERR_INTERNAL_ERROR;
     }
@@ -1147,6 +1256,10 @@ void get_integ_var(char *name, int *length) {
     string_copy(name, length, integ.var_name, integ.var_length);
 }
 
+static int return_to_integ_directly() {
+    return return_to_integ(false);
+}
+
 static int call_integ_fn() {
     if (integ.active_eq == NULL && integ.active_prgm_length == 0)
         return ERR_NONEXISTENT;
@@ -1178,6 +1291,8 @@ static int call_integ_fn() {
         }
     } else {
         clean_stack(integ.prev_sp);
+        if (call_fn_directly(integ.active_eq, return_to_integ_directly, &err))
+            return err;
         vartype_equation *eq = (vartype_equation *) integ.active_eq;
         current_prgm = eq->data;
         pc = 0;
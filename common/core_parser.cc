@@ -15,33 +15,96 @@
 /////  GeneratorContext  /////
 //////////////////////////////
 
+/* Arena for the Lines of a GeneratorContext, and for their XSTR text. The
+ * lines all live exactly as long as the context, so instead of allocating
+ * and freeing them one by one, they are carved out of large blocks, which
+ * are freed all at once when the context is deleted. Lines that are removed
+ * during optimization simply stay in their block until then.
+ * When a block can't be allocated, alloc() returns NULL and the arena
+ * remembers that it failed; GeneratorContext::store() then refuses to store
+ * the incomplete code.
+ */
+class LineArena {
+    private:
+
+    std::vector<char *> blocks;
+    size_t used;
+    size_t avail;
+    bool failed;
+
+    public:
+
+    LineArena() : used(0), avail(0), failed(false) {}
+
+    ~LineArena() {
+        for (int i = 0; i < blocks.size(); i++)
+            free(blocks[i]);
+    }
+
+    void *alloc(size_t n) {
+        n = (n + 7) & ~(size_t) 7;
+        if (n > avail || blocks.empty()) {
+            if (n > 256) {
+                // Oversized; keep using the current block for small stuff
+                char *block = (char *) malloc(n);
+                if (block == NULL) {
+                    failed = true;
+                    return NULL;
+                }
+                blocks.insert(blocks.begin(), block);
+                return block;
+            }
+            size_t size = 2048;
+            char *block = (char *) malloc(size);
+            if (block == NULL) {
+                failed = true;
+                return NULL;
+            }
+            blocks.push_back(block);
+            used = 0;
+            avail = size;
+        }
+        void *p = blocks.back() + used;
+        used += n;
+        avail -= n;
+        return p;
+    }
+
+    bool hasFailed() {
+        return failed;
+    }
+};
+
 struct Line {
     int pos;
     int cmd;
     arg_struct arg;
-    char *buf;
-    Line(int pos, int cmd) : pos(pos), cmd(cmd), buf(NULL) {
+    Line(int pos, int cmd) : pos(pos), cmd(cmd) {
         arg.type = ARGTYPE_NONE;
     }
-    Line(int pos, phloat d) : pos(pos), cmd(CMD_NUMBER), buf(NULL) {
+    Line(int pos, phloat d) : pos(pos), cmd(CMD_NUMBER) {
         arg.type = ARGTYPE_DOUBLE;
         arg.val_d = d;
     }
-    Line(int pos, int cmd, char s, bool ind) : pos(pos), cmd(cmd), buf(NULL) {
+    Line(int pos, int cmd, char s, bool ind) : pos(pos), cmd(cmd) {
         arg.type = ind ? ARGTYPE_IND_STK : ARGTYPE_STK;
         arg.val.stk = s;
     }
-    Line(int pos, int cmd, int n, bool ind) : pos(pos), cmd(cmd), buf(NULL) {
+    Line(int pos, int cmd, int n, bool ind) : pos(pos), cmd(cmd) {
         arg.type = ind ? ARGTYPE_IND_NUM : ARGTYPE_NUM;
         arg.val.num = n;
     }
-    Line(int pos, int cmd, std::string s, bool ind) : pos(pos), cmd(cmd), buf(NULL) {
+    Line(int pos, int cmd, const std::string &s, bool ind, LineArena *arena) : pos(pos), cmd(cmd) {
         if (cmd == CMD_XSTR) {
             int len = s.length();
             if (len > 65535)
                 len = 65535;
-            buf = (char *) malloc(len);
-            memcpy(buf, s.c_str(), len);
+            char *buf = (char *) arena->alloc(len);
+            if (buf == NULL)
+                // The arena has failed, and this line won't be stored
+                len = 0;
+            else
+                memcpy(buf, s.c_str(), len);
             arg.type = ARGTYPE_XSTR;
             arg.val.xstr = buf;
             arg.length = len;
@@ -54,8 +117,9 @@ struct Line {
             arg.length = len;
         }
     }
-    ~Line() {
-        free(buf);
+    // noexcept, so that a NULL from the arena skips the constructor
+    void *operator new(size_t size, LineArena *arena) noexcept {
+        return arena->alloc(size);
     }
 };
 
@@ -92,14 +156,14 @@ void CodeMap::write(int4 n) {
 int4 CodeMap::read(int *index) {
     if (*index >= size)
         return -2;
-    uint4 u;
+    uint4 u = 0;
     int offset = 0;
     int b;
     do {
         b = data[(*index)++];
-        u = (b & 127) << offset;
+        u |= (uint4) (b & 127) << offset;
         offset += 7;
-    } while ((b & 128) != 0);
+    } while ((b & 128) != 0 && *index < size);
     return u;
 }
 
@@ -112,25 +176,126 @@ void CodeMap::add(int pos, int4 line) {
         current_pos = pos;
         current_line = line;
     }
+    clearIndex();
 }
 
-int4 CodeMap::lookup(int4 line) {
+void CodeMap::clearIndex() {
+    free(index_lines);
+    free(index_pos);
+    index_lines = NULL;
+    index_pos = NULL;
+    index_count = -1;
+}
+
+bool CodeMap::buildIndex() {
+    // Every entry takes at least two bytes
+    int n = size / 2;
+    index_lines = (int4 *) malloc(n * sizeof(int4));
+    index_pos = (int4 *) malloc(n * sizeof(int4));
+    if (n > 0 && (index_lines == NULL || index_pos == NULL)) {
+        clearIndex();
+        return false;
+    }
     int index = 0;
     int4 cline = 0;
-    while (true) {
+    index_count = 0;
+    while (index_count < n) {
         int4 pos = read(&index);
         if (pos == -2)
-            return -1;
-        cline += read(&index);
-        if (line < cline)
-            // TODO: Handle pos = -1 by going up the RTN stack?
-            return pos;
+            break;
+        int4 lines = read(&index);
+        if (lines == -2)
+            break;
+        cline += lines;
+        index_lines[index_count] = cline;
+        index_pos[index_count] = pos;
+        index_count++;
+    }
+    return true;
+}
+
+int4 CodeMap::lookup(int4 line) {
+    if (size <= 0)
+        return -1;
+    if (index_count == -1 && !buildIndex())
+        return -1;
+    // First entry that ends after the given line
+    int lo = 0, hi = index_count;
+    while (lo < hi) {
+        int mid = (lo + hi) / 2;
+        if (line < index_lines[mid])
+            hi = mid;
+        else
+            lo = mid + 1;
+    }
+    // TODO: Handle pos = -1 by going up the RTN stack?
+    return lo < index_count ? index_pos[lo] : -1;
+}
+
+/* Number of lines of equation code generated, and stored after peephole
+ * optimization; see get_equation_code_stats()
+ */
+static int4 lines_generated = 0;
+static int4 lines_stored = 0;
+
+/* Commands that may skip the next line, i.e. that can return ERR_NO.
+ * Not every command with a question mark in its name is one of these;
+ * DIM?, ΣREG?, and WSIZE? just return a value. XEQ is included because the
+ * program it calls may return with RTNNO.
+ */
+static bool is_conditional(int cmd) {
+    switch (cmd) {
+        case CMD_FS_T:
+        case CMD_FC_T:
+        case CMD_FSC_T:
+        case CMD_FCC_T:
+        case CMD_XEQ:
+        case CMD_ISG:
+        case CMD_DSE:
+        case CMD_X_EQ_0:
+        case CMD_X_NE_0:
+        case CMD_X_LT_0:
+        case CMD_X_GT_0:
+        case CMD_X_LE_0:
+        case CMD_X_GE_0:
+        case CMD_X_EQ_Y:
+        case CMD_X_NE_Y:
+        case CMD_X_LT_Y:
+        case CMD_X_GT_Y:
+        case CMD_X_LE_Y:
+        case CMD_X_GE_Y:
+        case CMD_REAL_T:
+        case CMD_CPX_T:
+        case CMD_STR_T:
+        case CMD_MAT_T:
+        case CMD_BIT_T:
+        case CMD_FIND:
+        case CMD_HEAD:
+        case CMD_LIST_T:
+        case CMD_X_EQ_NN:
+        case CMD_X_NE_NN:
+        case CMD_X_LT_NN:
+        case CMD_X_GT_NN:
+        case CMD_X_LE_NN:
+        case CMD_X_GE_NN:
+        case CMD_0_EQ_NN:
+        case CMD_0_NE_NN:
+        case CMD_0_LT_NN:
+        case CMD_0_GT_NN:
+        case CMD_0_LE_NN:
+        case CMD_0_GE_NN:
+        case CMD_EQN_T:
+        case CMD_IF_T:
+            return true;
+        default:
+            return false;
     }
 }
 
 class GeneratorContext {
     private:
 
+    LineArena arena;
     std::vector<Line *> *lines;
     std::vector<std::vector<Line *> *> stack;
     std::vector<std::vector<Line *> *> queue;
@@ -149,29 +314,89 @@ class GeneratorContext {
     }
 
     ~GeneratorContext() {
-        for (int i = 0; i < lines->size(); i++)
-            delete (*lines)[i];
+        // The lines themselves are freed along with the arena
         delete lines;
+        for (int i = 0; i < queue.size(); i++)
+            delete queue[i];
+    }
+
+    void addLine(Line *line) {
+        // NULL if the arena has failed; see store()
+        if (line != NULL)
+            lines->push_back(line);
     }
 
     void addLine(int pos, int cmd) {
-        lines->push_back(new Line(pos, cmd));
+        addLine(new (&arena) Line(pos, cmd));
     }
 
     void addLine(int pos, phloat d) {
-        lines->push_back(new Line(pos, d));
+        addLine(new (&arena) Line(pos, d));
     }
 
     void addLine(int pos, int cmd, char s, bool ind = false) {
-        lines->push_back(new Line(pos, cmd, s, ind));
+        addLine(new (&arena) Line(pos, cmd, s, ind));
     }
 
     void addLine(int pos, int cmd, int n, bool ind = false) {
-        lines->push_back(new Line(pos, cmd, n, ind));
+        addLine(new (&arena) Line(pos, cmd, n, ind));
     }
 
     void addLine(int pos, int cmd, std::string s, bool ind = false) {
-        lines->push_back(new Line(pos, cmd, s, ind));
+        addLine(new (&arena) Line(pos, cmd, s, ind, &arena));
+    }
+
+    int lineCount() {
+        return lines->size();
+    }
+
+    /* For Σ loops that keep their index on the stack: replaces the RCLs of
+     * the index in the lines from 'begin' on with PICKs of the level where
+     * the index is, which is 'level' when nothing has been pushed on top of
+     * it yet. Returns false if the lines contain anything other than
+     * numbers, RCLs, X<>Y, and functions of one or two arguments, since
+     * then the depth can't be followed.
+     */
+    bool pickIndex(int begin, const std::string &name, int level) {
+        int len = name.length();
+        if (len > 7)
+            len = 7;
+        // First make sure all of it can be followed, then replace
+        for (int pass = 0; pass < 2; pass++) {
+            int depth = 0;
+            for (int i = begin; i < lines->size(); i++) {
+                Line *line = (*lines)[i];
+                int cmd = line->cmd;
+                if (cmd == CMD_NUMBER) {
+                    depth++;
+                } else if (cmd == CMD_RCL) {
+                    if (line->arg.type != ARGTYPE_STR)
+                        return false;
+                    if (line->arg.length == len
+                            && memcmp(line->arg.val.text, name.c_str(), len) == 0) {
+                        // PICK only takes two digits
+                        if (level + depth > 99)
+                            return false;
+                        if (pass == 1) {
+                            line->cmd = CMD_PICK;
+                            line->arg.type = ARGTYPE_NUM;
+                            line->arg.val.num = level + depth;
+                        }
+                    }
+                    depth++;
+                } else if (cmd == CMD_SWAP) {
+                    if (depth < 2)
+                        return false;
+                } else {
+                    int argcount = cmd_array[cmd].argcount;
+                    if (cmd_array[cmd].argtype != ARG_NONE
+                            || argcount < 1 || argcount > 2 || depth < argcount)
+                        return false;
+                    depth -= argcount - 1;
+                }
+            }
+        }
+        return true;
     }
 
     int nextLabel() {
@@ -212,8 +437,284 @@ class GeneratorContext {
         addLine(pos, CMD_XEQL, assertTwoRealsLbl);
     }
 
-    void store(prgm_struct *prgm, CodeMap *map) {
-        prgm->lclbl_invalid = 0;
+    /* Common subexpression elimination, for equations that are eligible for
+     * direct evaluation. Their code consists of nothing but numbers, RCLs,
+     * and functions without side effects, so a subexpression that occurs
+     * more than once can be computed once, saved in a local variable, and
+     * recalled after that. The names of those locals are in parentheses,
+     * so equations can't refer to them. Code containing Σ loops is left
+     * alone; the scan gives up when it gets to their XEQL.
+     */
+    void eliminateCommonSubexpressions() {
+        int tmp = 1;
+        while (eliminateCommonSubexpression(tmp))
+            tmp++;
+    }
+
+    private:
+
+    static void appendLine(std::string *key, Line *line) {
+        key->append((const char *) &line->cmd, sizeof(int));
+        key->append((const char *) &line->arg.type, 1);
+        switch (line->arg.type) {
+            case ARGTYPE_DOUBLE:
+                key->append((const char *) &line->arg.val_d, sizeof(phloat));
+                break;
+            case ARGTYPE_NUM:
+                key->append((const char *) &line->arg.val.num, sizeof(int4));
+                break;
+            case ARGTYPE_STR:
+                key->append((const char *) &line->arg.length, 1);
+                key->append(line->arg.val.text, line->arg.length);
+                break;
+        }
+    }
+
+    /* Replaces the biggest repeated subexpression, if doing so saves at least
+     * two lines. Returns false if there is none.
+     */
+    bool eliminateCommonSubexpression(int tmp) {
+        // Find the first line of the subexpression that ends at each line,
+        // by keeping track of where the code for each stack level starts.
+        // After a SWAP, the top level doesn't have a start of its own.
+        int n = lines->size();
+        std::vector<int> start(n, -1);
+        std::vector<int> levels;
+        for (int i = 2; i < n; i++) {
+            Line *line = (*lines)[i];
+            if (line->cmd == CMD_NUMBER || line->cmd == CMD_RCL) {
+                levels.push_back(i);
+                start[i] = i;
+            } else if (line->cmd == CMD_SWAP) {
+                if (levels.size() < 2)
+                    return false;
+                levels.back() = -1;
+            } else {
+                int argcount = cmd_array[line->cmd].argcount;
+                if (argcount < 1 || argcount > 2 || levels.size() < argcount)
+                    return false;
+                int s = levels[levels.size() - argcount];
+                levels.resize(levels.size() - argcount);
+                levels.push_back(s);
+                start[i] = s;
+            }
+        }
+
+        // Group identical subexpressions of three lines or more
+        std::map<std::string, std::vector<int> > occurrences;
+        for (int i = 2; i < n; i++) {
+            if (start[i] == -1 || i - start[i] < 2)
+                continue;
+            std::string key;
+            for (int j = start[i]; j <= i; j++)
+                appendLine(&key, (*lines)[j]);
+            std::vector<int> *ends = &occurrences[key];
+            if (ends->empty() || start[i] > ends->back())
+                ends->push_back(i);
+        }
+        std::vector<int> *best = NULL;
+        int bestLength = 0;
+        for (std::map<std::string, std::vector<int> >::iterator it = occurrences.begin(); it != occurrences.end(); it++) {
+            std::vector<int> *ends = &it->second;
+            int count = ends->size();
+            int length = (*ends)[0] - start[(*ends)[0]] + 1;
+            // Each repeat becomes one RCL, plus one LSTO
+            if ((count - 1) * (length - 1) - 1 < 2)
+                continue;
+            if (length > bestLength || length == bestLength && (*ends)[0] < (*best)[0]) {
+                best = ends;
+                bestLength = length;
+            }
+        }
+        if (best == NULL)
+            return false;
+
+        char name[8];
+        snprintf(name, 8, "(%d)", tmp);
+        for (int k = best->size() - 1; k >= 1; k--) {
+            int end = (*best)[k];
+            int begin = start[end];
+            Line *rcl = new (&arena) Line((*lines)[end]->pos, CMD_RCL, std::string(name), false, &arena);
+            if (rcl == NULL)
+                return false;
+            lines->erase(lines->begin() + begin + 1, lines->begin() + end + 1);
+            (*lines)[begin] = rcl;
+        }
+        int end = (*best)[0];
+        Line *lsto = new (&arena) Line((*lines)[end]->pos, CMD_LSTO, std::string(name), false, &arena);
+        if (lsto == NULL)
+            return false;
+        lines->insert(lines->begin() + end + 1, lsto);
+        return true;
+    }
+
+    public:
+
+    /* Removes the lines in [begin, end), but only if that doesn't change
+     * which line a conditional would skip.
+     */
+    bool removeLines(int begin, int end) {
+        for (int i = begin - 1; i >= 0; i--) {
+            int cmd = (*lines)[i]->cmd;
+            if (cmd == CMD_LBL)
+                continue;
+            if (is_conditional(cmd))
+                return false;
+            break;
+        }
+        lines->erase(lines->begin() + begin, lines->begin() + end);
+        return true;
+    }
+
+    /* Returns the first line that isn't a label, starting at the given
+     * line; past the end, that is the END, which acts as RTN.
+     */
+    Line *lineAt(int i) {
+        static Line end(-1, CMD_RTN);
+        while (i < lines->size() && (*lines)[i]->cmd == CMD_LBL)
+            i++;
+        return i < lines->size() ? (*lines)[i] : &end;
+    }
+
+    /* Peephole optimization: removes lines that the generator emits because
+     * it puts together code for subexpressions without looking at their
+     * neighbors, e.g. SWAP SWAP, numbers that are dropped right away, calls
+     * to subroutines that return immediately, and type checks on operands
+     * that are known to be real numbers.
+     * Lines keep their positions, so the CodeMap remains correct.
+     */
+    void optimize() {
+        bool changed;
+        do {
+            changed = false;
+            std::map<int, int> label2index;
+            for (int i = 0; i < lines->size(); i++)
+                if ((*lines)[i]->cmd == CMD_LBL)
+                    label2index[(*lines)[i]->arg.val.num] = i;
+            // For the top few stack levels, whether they are known to
+            // contain real numbers
+            std::vector<bool> real;
+            // Whether the current line follows a conditional, and so may
+            // be skipped
+            bool skippable = false;
+            for (int i = 0; i < lines->size() && !changed; i++) {
+                Line *line = (*lines)[i];
+                int cmd = line->cmd;
+                bool maybe_skipped = skippable;
+                skippable = is_conditional(cmd);
+                int nextCmd = i + 1 < lines->size() ? (*lines)[i + 1]->cmd : CMD_NONE;
+                if (cmd == CMD_SWAP && nextCmd == CMD_SWAP
+                        || (cmd == CMD_NUMBER || cmd == CMD_XSTR) && nextCmd == CMD_DROP) {
+                    changed = removeLines(i, i + 2);
+                    continue;
+                }
+                if (cmd == CMD_GTOL || cmd == CMD_XEQL) {
+                    Line *target = lineAt(label2index[line->arg.val.num]);
+                    if (target->cmd == CMD_RTN) {
+                        if (cmd == CMD_XEQL) {
+                            changed = removeLines(i, i + 1);
+                        } else {
+                            line->cmd = CMD_RTN;
+                            line->arg.type = ARGTYPE_NONE;
+                            changed = true;
+                        }
+                        continue;
+                    }
+                    if (cmd == CMD_GTOL && target->cmd == CMD_GTOL && target != line
+                            && target->arg.val.num != line->arg.val.num) {
+                        line->arg.val.num = target->arg.val.num;
+                        changed = true;
+                        continue;
+                    }
+                    if (cmd == CMD_GTOL && label2index[line->arg.val.num] > i
+                            && target == lineAt(i + 1)) {
+                        changed = removeLines(i, i + 1);
+                        continue;
+                    }
+                }
+                if (cmd == CMD_XEQL && line->arg.val.num == assertTwoRealsLbl) {
+                    int n = real.size();
+                    if (n >= 2 && real[n - 1] && real[n - 2]) {
+                        changed = removeLines(i, i + 1);
+                        continue;
+                    }
+                    real.clear();
+                    if (!maybe_skipped) {
+                        real.push_back(true);
+                        real.push_back(true);
+                    }
+                    continue;
+                }
+                // Keep track of real numbers, within straight-line code
+                switch (cmd) {
+                    case CMD_NUMBER:
+                        real.push_back(true);
+                        break;
+                    case CMD_RCL:
+                    case CMD_XSTR:
+                        real.push_back(false);
+                        break;
+                    case CMD_SWAP:
+                        if (real.size() >= 2) {
+                            int n = real.size();
+                            bool t = real[n - 1];
+                            real[n - 1] = real[n - 2];
+                            real[n - 2] = t;
+                        } else
+                            real.clear();
+                        break;
+                    case CMD_DROP:
+                        if (!real.empty())
+                            real.pop_back();
+                        break;
+                    case CMD_CHS:
+                    case CMD_SQUARE:
+                        break;
+                    case CMD_ADD:
+                    case CMD_SUB:
+                    case CMD_MUL:
+                    case CMD_DIV:
+                        if (real.size() >= 2) {
+                            bool r = real.back();
+                            real.pop_back();
+                            real.back() = real.back() && r;
+                        } else
+                            real.clear();
+                        break;
+                    default:
+                        real.clear();
+                        break;
+                }
+                if (maybe_skipped)
+                    // Whatever this line did may or may not have happened
+                    real.clear();
+            }
+        } while (changed);
+
+        // Remove the type check subroutine if it isn't used anymore
+        if (assertTwoRealsLbl != -1) {
+            for (int i = 0; i < lines->size(); i++) {
+                Line *line = (*lines)[i];
+                if (line->cmd == CMD_XEQL && line->arg.val.num == assertTwoRealsLbl)
+                    return;
+            }
+            int begin = 0;
+            while ((*lines)[begin]->cmd != CMD_LBL || (*lines)[begin]->arg.val.num != assertTwoRealsLbl)
+                begin++;
+            int end = begin;
+            while (end < lines->size() && (*lines)[end]->cmd != CMD_RTN)
+                end++;
+            // Along with the RTN that separates it from the preceding code
+            lines->erase(lines->begin() + begin - 1, lines->begin() + end);
+            assertTwoRealsLbl = -1;
+        }
+    }
+
+    /* Stores the generated code in prgm. Returns false, without storing
+     * anything, if the arena ran out of memory while the code was being
+     * generated, since some of the lines are then missing.
+     */
+    bool store(prgm_struct *prgm, CodeMap *map) {
         // Tack all the subroutines onto the main code
         for (int i = 0; i < queue.size(); i++) {
             addLine(-1, CMD_RTN);
@@ -222,6 +723,19 @@ class GeneratorContext {
             delete l;
         }
         queue.clear();
+        // Start with an empty program either way, so that the caller can
+        // free it as usual if we fail
+        prgm->lclbl_invalid = 0;
+        prgm->text = NULL;
+        prgm->decoded = NULL;
+        prgm->size = 0;
+        prgm->capacity = 0;
+        if (arena.hasFailed())
+            return false;
+        for (int i = 0; i < lines->size(); i++)
+            if ((*lines)[i]->cmd != CMD_LBL)
+                lines_generated++;
+        optimize();
         // First, resolve labels
         std::map<int, int> label2line;
         int lineno = 1;
@@ -240,9 +754,6 @@ class GeneratorContext {
         // Label resolution done
         pgm_index saved_prgm = current_prgm;
         current_prgm.set_eqn(prgm->eq_data->eqn_index);
-        prgm->text = NULL;
-        prgm->size = 0;
-        prgm->capacity = 0;
         // Temporarily turn off PRGM mode. This is because
         // store_command() usually refuses to insert commands
         // in programs above prgms_count, in order to prevent
@@ -265,6 +776,7 @@ class GeneratorContext {
             if (line->cmd == CMD_LBL)
                 continue;
             lineno++;
+            lines_stored++;
             store_command_after(&pc, line->cmd, &line->arg, NULL);
             if (map != NULL)
                 map->add(line->pos, lineno);
@@ -275,9 +787,61 @@ class GeneratorContext {
         flags.f.prgm_mode = saved_prgm_mode;
         flags.f.printer_exists = prev_printer_exists;
         loading_state = prev_loading_state;
+        return true;
     }
 };
 
+/* Executes one command during direct evaluation, the way continue_running()
+ * would: with stack lift enabled, which is how every command that can appear
+ * in a directly evaluated equation leaves it.
+ */
+static int direct_command(int cmd, arg_struct *arg = NULL) {
+    arg_struct noarg;
+    if (arg == NULL) {
+        noarg.type = ARGTYPE_NONE;
+        arg = &noarg;
+    }
+    flags.f.stack_lift_disable = 0;
+    return handle(cmd, arg);
+}
+
+static int direct_number(phloat x) {
+    arg_struct arg;
+    arg.type = ARGTYPE_DOUBLE;
+    arg.val_d = x;
+    return direct_command(CMD_NUMBER, &arg);
+}
+
+/* Pops a real number off the stack during direct evaluation */
+static int direct_pop_real(phloat *x) {
+    vartype *v = stack[sp];
+    if (v->type != TYPE_REAL)
+        return ERR_INVALID_TYPE;
+    *x = ((vartype_real *) v)->x;
+    sp--;
+    free_vartype(v);
+    return ERR_NONE;
+}
+
+/* The indexes of the Σ loops being evaluated directly, innermost last.
+ * Nothing in a directly evaluated summand can look at variables other than
+ * by recalling them, so instead of storing the index in a local variable on
+ * every iteration, Sigma::evaluate() keeps it here, and Variable::evaluate()
+ * looks here first.
+ */
+struct direct_index {
+    const std::string *name;
+    phloat value;
+};
+static std::vector<direct_index> direct_indexes;
+
+/* Direct evaluation can't be interrupted, so the Σ sums in one evaluation
+ * may add up to MAX_DIRECT_TERMS terms between them, nested ones included;
+ * evaluate_tree() sets the budget, and Sigma::evaluate() spends it.
+ */
+#define MAX_DIRECT_TERMS 10000
+static int4 direct_terms_left;
+
 //////////////////////////////////////////////
 /////  Boilerplate Evaluator subclasses  /////
 //////////////////////////////////////////////
@@ -296,6 +860,32 @@ class UnaryEvaluator : public Evaluator {
     ~UnaryEvaluator() {
         delete ev;
     }
+
+    /* Functions that compile to their argument followed by a single
+     * command return that command here, which makes them eligible for
+     * direct evaluation.
+     */
+    virtual int directCmd() { return CMD_NONE; }
+
+    bool isDirect() {
+        return directCmd() != CMD_NONE && ev->isDirect();
+    }
+
+    Evaluator *simplify();
+    bool isNumeric();
+
+    Evaluator *derivative(const std::string &name);
+    /* The derivative of the function with respect to its argument, or NULL
+     * if not known; derivative() applies the chain rule.
+     */
+    virtual Evaluator *derivativeOfFunction() { return NULL; }
+
+    int evaluate() {
+        int err = ev->evaluate();
+        if (err != ERR_NONE)
+            return err;
+        return direct_command(directCmd());
+    }
     
     void collectVariables(std::vector<std::string> *vars, std::vector<std::string> *locals) {
         ev->collectVariables(vars, locals);
@@ -326,6 +916,54 @@ class BinaryEvaluator : public Evaluator {
         delete left;
         delete right;
     }
+
+    /* See UnaryEvaluator::directCmd() */
+    virtual int directCmd() { return CMD_NONE; }
+
+    bool isDirect() {
+        return directCmd() != CMD_NONE && left->isDirect() && right->isDirect();
+    }
+
+    void simplifyArgs() {
+        left = left->simplify();
+        if (right != NULL)
+            right = right->simplify();
+    }
+
+    Evaluator *replaceByLeft() {
+        Evaluator *res = left;
+        left = NULL;
+        delete this;
+        return res;
+    }
+
+    Evaluator *replaceByRight() {
+        Evaluator *res = right;
+        right = NULL;
+        delete this;
+        return res;
+    }
+
+    Evaluator *simplify();
+    bool isNumeric();
+
+    Evaluator *derivative(const std::string &name);
+    /* The derivative of the operation, given the derivatives of its
+     * arguments, or NULL if not known. Takes ownership of dl and dr,
+     * except when returning NULL.
+     */
+    virtual Evaluator *derivativeOfOperation(Evaluator *dl, Evaluator *dr) { return NULL; }
+
+    int evaluate() {
+        int err = left->evaluate();
+        if (err == ERR_NONE)
+            err = right->evaluate();
+        if (err == ERR_NONE && swapArgs)
+            err = direct_command(CMD_SWAP);
+        if (err != ERR_NONE)
+            return err;
+        return direct_command(directCmd());
+    }
     
     void collectVariables(std::vector<std::string> *vars, std::vector<std::string> *locals) {
         left->collectVariables(vars, locals);
@@ -388,11 +1026,14 @@ class Acos : public UnaryEvaluator {
     }
 
     Evaluator *invert(const std::string &name, Evaluator *rhs);
+    Evaluator *derivativeOfFunction();
 
     void generateCode(GeneratorContext *ctx) {
         ev->generateCode(ctx);
         ctx->addLine(tpos, CMD_ACOS);
     }
+
+    int directCmd() { return CMD_ACOS; }
 };
 
 ///////////////////
@@ -410,11 +1051,14 @@ class Acosh : public UnaryEvaluator {
     }
 
     Evaluator *invert(const std::string &name, Evaluator *rhs);
+    Evaluator *derivativeOfFunction();
 
     void generateCode(GeneratorContext *ctx) {
         ev->generateCode(ctx);
         ctx->addLine(tpos, CMD_ACOSH);
     }
+
+    int directCmd() { return CMD_ACOSH; }
 };
 
 //////////////////
@@ -432,11 +1076,14 @@ class Alog : public UnaryEvaluator {
     }
 
     Evaluator *invert(const std::string &name, Evaluator *rhs);
+    Evaluator *derivativeOfFunction();
 
     void generateCode(GeneratorContext *ctx) {
         ev->generateCode(ctx);
         ctx->addLine(tpos, CMD_10_POW_X);
     }
+
+    int directCmd() { return CMD_10_POW_X; }
 };
 
 /////////////////
@@ -460,6 +1107,8 @@ class And : public BinaryEvaluator {
         right->generateCode(ctx);
         ctx->addLine(tpos, CMD_GEN_AND);
     }
+
+    int directCmd() { return CMD_GEN_AND; }
 };
 
 ///////////////////
@@ -517,11 +1166,14 @@ class Asin : public UnaryEvaluator {
     }
 
     Evaluator *invert(const std::string &name, Evaluator *rhs);
+    Evaluator *derivativeOfFunction();
 
     void generateCode(GeneratorContext *ctx) {
         ev->generateCode(ctx);
         ctx->addLine(tpos, CMD_ASIN);
     }
+
+    int directCmd() { return CMD_ASIN; }
 };
 
 ///////////////////
@@ -539,11 +1191,14 @@ class Asinh : public UnaryEvaluator {
     }
 
     Evaluator *invert(const std::string &name, Evaluator *rhs);
+    Evaluator *derivativeOfFunction();
 
     void generateCode(GeneratorContext *ctx) {
         ev->generateCode(ctx);
         ctx->addLine(tpos, CMD_ASINH);
     }
+
+    int directCmd() { return CMD_ASINH; }
 };
 
 ///////////////////
@@ -654,11 +1309,14 @@ class Atan : public UnaryEvaluator {
     }
 
     Evaluator *invert(const std::string &name, Evaluator *rhs);
+    Evaluator *derivativeOfFunction();
 
     void generateCode(GeneratorContext *ctx) {
         ev->generateCode(ctx);
         ctx->addLine(tpos, CMD_ATAN);
     }
+
+    int directCmd() { return CMD_ATAN; }
 };
 
 ///////////////////
@@ -676,11 +1334,14 @@ class Atanh : public UnaryEvaluator {
     }
 
     Evaluator *invert(const std::string &name, Evaluator *rhs);
+    Evaluator *derivativeOfFunction();
 
     void generateCode(GeneratorContext *ctx) {
         ev->generateCode(ctx);
         ctx->addLine(tpos, CMD_ATANH);
     }
+
+    int directCmd() { return CMD_ATANH; }
 };
 
 //////////////////
@@ -704,6 +1365,8 @@ class Badd : public BinaryEvaluator {
         right->generateCode(ctx);
         ctx->addLine(tpos, CMD_BASEADD);
     }
+
+    int directCmd() { return CMD_BASEADD; }
 };
 
 //////////////////
@@ -725,6 +1388,8 @@ class Band : public BinaryEvaluator {
         right->generateCode(ctx);
         ctx->addLine(tpos, CMD_AND);
     }
+
+    int directCmd() { return CMD_AND; }
 };
 
 //////////////////
@@ -751,6 +1416,8 @@ class Bdiv : public BinaryEvaluator {
             ctx->addLine(tpos, CMD_SWAP);
         ctx->addLine(tpos, CMD_BASEDIV);
     }
+
+    int directCmd() { return CMD_BASEDIV; }
 };
 
 //////////////////
@@ -774,6 +1441,8 @@ class Bmul : public BinaryEvaluator {
         right->generateCode(ctx);
         ctx->addLine(tpos, CMD_BASEMUL);
     }
+
+    int directCmd() { return CMD_BASEMUL; }
 };
 
 //////////////////
@@ -796,6 +1465,8 @@ class Bneg : public UnaryEvaluator {
         ev->generateCode(ctx);
         ctx->addLine(tpos, CMD_BASECHS);
     }
+
+    int directCmd() { return CMD_BASECHS; }
 };
 
 //////////////////
@@ -818,6 +1489,8 @@ class Bnot : public UnaryEvaluator {
         ev->generateCode(ctx);
         ctx->addLine(tpos, CMD_NOT);
     }
+
+    int directCmd() { return CMD_NOT; }
 };
 
 /////////////////
@@ -839,6 +1512,8 @@ class Bor : public BinaryEvaluator {
         right->generateCode(ctx);
         ctx->addLine(tpos, CMD_OR);
     }
+
+    int directCmd() { return CMD_OR; }
 };
 
 ///////////////////
@@ -894,6 +1569,8 @@ class Bsub : public BinaryEvaluator {
             ctx->addLine(tpos, CMD_SWAP);
         ctx->addLine(tpos, CMD_BASESUB);
     }
+
+    int directCmd() { return CMD_BASESUB; }
 };
 
 //////////////////
@@ -917,6 +1594,8 @@ class Bxor : public BinaryEvaluator {
         right->generateCode(ctx);
         ctx->addLine(tpos, CMD_XOR);
     }
+
+    int directCmd() { return CMD_XOR; }
 };
 
 //////////////////
@@ -997,6 +1676,8 @@ class Comb : public BinaryEvaluator {
         right->generateCode(ctx);
         ctx->addLine(tpos, CMD_COMB);
     }
+
+    int directCmd() { return CMD_COMB; }
 };
 
 ///////////////////////
@@ -1020,6 +1701,8 @@ class CompareEQ : public BinaryEvaluator {
         right->generateCode(ctx);
         ctx->addLine(tpos, CMD_GEN_EQ);
     }
+
+    int directCmd() { return CMD_GEN_EQ; }
 };
 
 ///////////////////////
@@ -1043,6 +1726,8 @@ class CompareNE : public BinaryEvaluator {
         right->generateCode(ctx);
         ctx->addLine(tpos, CMD_GEN_NE);
     }
+
+    int directCmd() { return CMD_GEN_NE; }
 };
 
 ///////////////////////
@@ -1066,6 +1751,8 @@ class CompareLT : public BinaryEvaluator {
         right->generateCode(ctx);
         ctx->addLine(tpos, CMD_GEN_LT);
     }
+
+    int directCmd() { return CMD_GEN_LT; }
 };
 
 ///////////////////////
@@ -1089,6 +1776,8 @@ class CompareLE : public BinaryEvaluator {
         right->generateCode(ctx);
         ctx->addLine(tpos, CMD_GEN_LE);
     }
+
+    int directCmd() { return CMD_GEN_LE; }
 };
 
 ///////////////////////
@@ -1112,6 +1801,8 @@ class CompareGT : public BinaryEvaluator {
         right->generateCode(ctx);
         ctx->addLine(tpos, CMD_GEN_GT);
     }
+
+    int directCmd() { return CMD_GEN_GT; }
 };
 
 ///////////////////////
@@ -1135,6 +1826,8 @@ class CompareGE : public BinaryEvaluator {
         right->generateCode(ctx);
         ctx->addLine(tpos, CMD_GEN_GE);
     }
+
+    int directCmd() { return CMD_GEN_GE; }
 };
 
 //////////////////////
@@ -1181,11 +1874,14 @@ class Cos : public UnaryEvaluator {
     }
 
     Evaluator *invert(const std::string &name, Evaluator *rhs);
+    Evaluator *derivativeOfFunction();
 
     void generateCode(GeneratorContext *ctx) {
         ev->generateCode(ctx);
         ctx->addLine(tpos, CMD_COS);
     }
+
+    int directCmd() { return CMD_COS; }
 };
 
 //////////////////
@@ -1203,11 +1899,14 @@ class Cosh : public UnaryEvaluator {
     }
 
     Evaluator *invert(const std::string &name, Evaluator *rhs);
+    Evaluator *derivativeOfFunction();
 
     void generateCode(GeneratorContext *ctx) {
         ev->generateCode(ctx);
         ctx->addLine(tpos, CMD_COSH);
     }
+
+    int directCmd() { return CMD_COSH; }
 };
 
 ///////////////////
@@ -1255,6 +1954,8 @@ class Date : public BinaryEvaluator {
             ctx->addLine(tpos, CMD_SWAP);
         ctx->addLine(tpos, CMD_DATE_PLUS);
     }
+
+    int directCmd() { return CMD_DATE_PLUS; }
 };
 
 ///////////////////
@@ -1326,6 +2027,8 @@ class Dec : public UnaryEvaluator {
         ev->generateCode(ctx);
         ctx->addLine(tpos, CMD_TO_DEC);
     }
+
+    int directCmd() { return CMD_TO_DEC; }
 };
 
 /////////////////
@@ -1348,6 +2051,8 @@ class Deg : public UnaryEvaluator {
         ev->generateCode(ctx);
         ctx->addLine(tpos, CMD_TO_DEG);
     }
+
+    int directCmd() { return CMD_TO_DEG; }
 };
 
 ////////////////////////
@@ -1366,6 +2071,8 @@ class Difference : public BinaryEvaluator {
     }
 
     Evaluator *invert(const std::string &name, Evaluator *rhs);
+    Evaluator *derivativeOfOperation(Evaluator *dl, Evaluator *dr);
+    Evaluator *simplify();
 
     void generateCode(GeneratorContext *ctx) {
         left->generateCode(ctx);
@@ -1374,6 +2081,8 @@ class Difference : public BinaryEvaluator {
             ctx->addLine(tpos, CMD_SWAP);
         ctx->addLine(tpos, CMD_SUB);
     }
+
+    int directCmd() { return CMD_SUB; }
 };
 
 /////////////////
@@ -1464,6 +2173,8 @@ class Equation : public BinaryEvaluator {
         return new Equation(tpos, left->clone(f), right->clone(f));
     }
 
+    Evaluator *derivativeOfOperation(Evaluator *dl, Evaluator *dr);
+
     void getSides(const std::string &name, Evaluator **lhs, Evaluator **rhs) {
         if (left->howMany(name) == 1) {
             *lhs = left;
@@ -1479,6 +2190,14 @@ class Equation : public BinaryEvaluator {
         right->generateCode(ctx);
         ctx->addLine(tpos, CMD_SUB);
     }
+
+    int directCmd() { return CMD_SUB; }
+
+    Evaluator *simplify() {
+        // Keep the sides apart; isolate() needs them
+        simplifyArgs();
+        return this;
+    }
 };
 
 /////////////////
@@ -1530,11 +2249,14 @@ class Exp : public UnaryEvaluator {
     }
 
     Evaluator *invert(const std::string &name, Evaluator *rhs);
+    Evaluator *derivativeOfFunction();
 
     void generateCode(GeneratorContext *ctx) {
         ev->generateCode(ctx);
         ctx->addLine(tpos, CMD_E_POW_X);
     }
+
+    int directCmd() { return CMD_E_POW_X; }
 };
 
 ///////////////////
@@ -1552,11 +2274,14 @@ class Expm1 : public UnaryEvaluator {
     }
 
     Evaluator *invert(const std::string &name, Evaluator *rhs);
+    Evaluator *derivativeOfFunction();
 
     void generateCode(GeneratorContext *ctx) {
         ev->generateCode(ctx);
         ctx->addLine(tpos, CMD_E_POW_X_1);
     }
+
+    int directCmd() { return CMD_E_POW_X_1; }
 };
 
 /////////////////
@@ -1705,6 +2430,8 @@ class Hms : public UnaryEvaluator {
         ev->generateCode(ctx);
         ctx->addLine(tpos, CMD_TO_HMS);
     }
+
+    int directCmd() { return CMD_TO_HMS; }
 };
 
 ////////////////////
@@ -1728,6 +2455,8 @@ class Hmsadd : public BinaryEvaluator {
         right->generateCode(ctx);
         ctx->addLine(tpos, CMD_HMSADD);
     }
+
+    int directCmd() { return CMD_HMSADD; }
 };
 
 ////////////////////
@@ -1754,6 +2483,8 @@ class Hmssub : public BinaryEvaluator {
             ctx->addLine(tpos, CMD_SWAP);
         ctx->addLine(tpos, CMD_HMSSUB);
     }
+
+    int directCmd() { return CMD_HMSSUB; }
 };
 
 /////////////////
@@ -1776,6 +2507,8 @@ class Hrs : public UnaryEvaluator {
         ev->generateCode(ctx);
         ctx->addLine(tpos, CMD_TO_HR);
     }
+
+    int directCmd() { return CMD_TO_HR; }
 };
 
 //////////////////
@@ -1798,6 +2531,15 @@ class Idiv : public BinaryEvaluator {
         ctx->addLine(tpos, CMD_DIV);
         ctx->addLine(tpos, CMD_IP);
     }
+
+    int directCmd() { return CMD_DIV; }
+
+    int evaluate() {
+        int err = BinaryEvaluator::evaluate();
+        if (err != ERR_NONE)
+            return err;
+        return direct_command(CMD_IP);
+    }
 };
 
 ////////////////
@@ -1825,6 +2567,13 @@ class If : public Evaluator {
         return new If(tpos, condition->clone(f), trueEv->clone(f), falseEv->clone(f));
     }
 
+    Evaluator *simplify() {
+        condition = condition->simplify();
+        trueEv = trueEv->simplify();
+        falseEv = falseEv->simplify();
+        return this;
+    }
+
     Evaluator *invert(const std::string &name, Evaluator *rhs);
 
     void generateCode(GeneratorContext *ctx) {
@@ -1964,11 +2713,14 @@ class Inv : public UnaryEvaluator {
     }
 
     Evaluator *invert(const std::string &name, Evaluator *rhs);
+    Evaluator *derivativeOfFunction();
 
     void generateCode(GeneratorContext *ctx) {
         ev->generateCode(ctx);
         ctx->addLine(tpos, CMD_INV);
     }
+
+    int directCmd() { return CMD_INV; }
 };
 
 //////////////////
@@ -2049,10 +2801,26 @@ class Literal : public Evaluator {
         return new Literal(tpos, value);
     }
 
+    bool getLiteral(phloat *value) {
+        *value = this->value;
+        return true;
+    }
+
+    bool isNumeric() { return true; }
+
     void generateCode(GeneratorContext *ctx) {
         ctx->addLine(tpos, value);
     }
 
+    bool isDirect() { return true; }
+
+    int evaluate() {
+        arg_struct arg;
+        arg.type = ARGTYPE_DOUBLE;
+        arg.val_d = value;
+        return direct_command(CMD_NUMBER, &arg);
+    }
+
     void collectVariables(std::vector<std::string> *vars, std::vector<std::string> *locals) {
         // nope
     }
@@ -2077,11 +2845,14 @@ class Ln : public UnaryEvaluator {
     }
 
     Evaluator *invert(const std::string &name, Evaluator *rhs);
+    Evaluator *derivativeOfFunction();
 
     void generateCode(GeneratorContext *ctx) {
         ev->generateCode(ctx);
         ctx->addLine(tpos, CMD_LN);
     }
+
+    int directCmd() { return CMD_LN; }
 };
 
 //////////////////
@@ -2099,11 +2870,14 @@ class Ln1p : public UnaryEvaluator {
     }
 
     Evaluator *invert(const std::string &name, Evaluator *rhs);
+    Evaluator *derivativeOfFunction();
 
     void generateCode(GeneratorContext *ctx) {
         ev->generateCode(ctx);
         ctx->addLine(tpos, CMD_LN_1_X);
     }
+
+    int directCmd() { return CMD_LN_1_X; }
 };
 
 /////////////////
@@ -2121,11 +2895,14 @@ class Log : public UnaryEvaluator {
     }
 
     Evaluator *invert(const std::string &name, Evaluator *rhs);
+    Evaluator *derivativeOfFunction();
 
     void generateCode(GeneratorContext *ctx) {
         ev->generateCode(ctx);
         ctx->addLine(tpos, CMD_LOG);
     }
+
+    int directCmd() { return CMD_LOG; }
 };
 
 /////////////////
@@ -2255,6 +3032,8 @@ class Mod : public BinaryEvaluator {
         right->generateCode(ctx);
         ctx->addLine(tpos, CMD_MOD);
     }
+
+    int directCmd() { return CMD_MOD; }
 };
 
 /////////////////////
@@ -2281,6 +3060,8 @@ class NameTag : public UnaryEvaluator {
         return new NameTag(tpos, name, new std::vector<std::string>(*params), ev->clone(f));
     }
 
+    Evaluator *derivative(const std::string &name);
+
     void getSides(const std::string &name, Evaluator **lhs, Evaluator **rhs) {
         ev->getSides(name, lhs, rhs);
     }
@@ -2296,6 +3077,14 @@ class NameTag : public UnaryEvaluator {
     void generateCode(GeneratorContext *ctx) {
         ev->generateCode(ctx);
     }
+
+    bool isDirect() {
+        return ev->isDirect();
+    }
+
+    int evaluate() {
+        return ev->evaluate();
+    }
 };
 
 //////////////////////
@@ -2313,11 +3102,16 @@ class Negative : public UnaryEvaluator {
     }
 
     Evaluator *invert(const std::string &name, Evaluator *rhs);
+    Evaluator *derivativeOfFunction();
+    Evaluator *simplify();
+    bool isNegative() { return true; }
 
     void generateCode(GeneratorContext *ctx) {
         ev->generateCode(ctx);
         ctx->addLine(tpos, CMD_CHS);
     }
+
+    int directCmd() { return CMD_CHS; }
 };
 
 ////////////////////
@@ -2361,6 +3155,8 @@ class Oct : public UnaryEvaluator {
         ev->generateCode(ctx);
         ctx->addLine(tpos, CMD_TO_OCT);
     }
+
+    int directCmd() { return CMD_TO_OCT; }
 };
 
 ////////////////
@@ -2384,6 +3180,8 @@ class Or : public BinaryEvaluator {
         right->generateCode(ctx);
         ctx->addLine(tpos, CMD_GEN_OR);
     }
+
+    int directCmd() { return CMD_GEN_OR; }
 };
 
 /////////////////////
@@ -2427,6 +3225,8 @@ class Perm : public BinaryEvaluator {
         right->generateCode(ctx);
         ctx->addLine(tpos, CMD_PERM);
     }
+
+    int directCmd() { return CMD_PERM; }
 };
 
 ///////////////////
@@ -2445,6 +3245,7 @@ class Power : public BinaryEvaluator {
     }
 
     Evaluator *invert(const std::string &name, Evaluator *rhs);
+    Evaluator *derivativeOfOperation(Evaluator *dl, Evaluator *dr);
 
     void generateCode(GeneratorContext *ctx) {
         left->generateCode(ctx);
@@ -2453,6 +3254,8 @@ class Power : public BinaryEvaluator {
             ctx->addLine(tpos, CMD_SWAP);
         ctx->addLine(tpos, CMD_Y_POW_X);
     }
+
+    int directCmd() { return CMD_Y_POW_X; }
 };
 
 /////////////////////
@@ -2470,12 +3273,16 @@ class Product : public BinaryEvaluator {
     }
 
     Evaluator *invert(const std::string &name, Evaluator *rhs);
+    Evaluator *derivativeOfOperation(Evaluator *dl, Evaluator *dr);
+    Evaluator *simplify();
 
     void generateCode(GeneratorContext *ctx) {
         left->generateCode(ctx);
         right->generateCode(ctx);
         ctx->addLine(tpos, CMD_MUL);
     }
+
+    int directCmd() { return CMD_MUL; }
 };
 
 //////////////////////
@@ -2494,6 +3301,8 @@ class Quotient : public BinaryEvaluator {
     }
 
     Evaluator *invert(const std::string &name, Evaluator *rhs);
+    Evaluator *derivativeOfOperation(Evaluator *dl, Evaluator *dr);
+    Evaluator *simplify();
 
     void generateCode(GeneratorContext *ctx) {
         left->generateCode(ctx);
@@ -2502,6 +3311,8 @@ class Quotient : public BinaryEvaluator {
             ctx->addLine(tpos, CMD_SWAP);
         ctx->addLine(tpos, CMD_DIV);
     }
+
+    int directCmd() { return CMD_DIV; }
 };
 
 /////////////////
@@ -2524,6 +3335,8 @@ class Rad : public UnaryEvaluator {
         ev->generateCode(ctx);
         ctx->addLine(tpos, CMD_TO_RAD);
     }
+
+    int directCmd() { return CMD_TO_RAD; }
 };
 
 ////////////////////
@@ -2607,6 +3420,8 @@ class RecallFunction : public Evaluator {
         return new RecallFunction(tpos, cmd);
     }
 
+    Evaluator *simplify();
+
     void generateCode(GeneratorContext *ctx) {
         ctx->addLine(tpos, cmd);
     }
@@ -2778,6 +3593,12 @@ class Seq : public Evaluator {
         return new Seq(tpos, evs2);
     }
 
+    Evaluator *simplify() {
+        for (int i = 0; i < evs->size(); i++)
+            (*evs)[i] = (*evs)[i]->simplify();
+        return this;
+    }
+
     void generateCode(GeneratorContext *ctx) {
         for (int i = 0; i < evs->size() - 1; i++) {
             (*evs)[i]->generateCode(ctx);
@@ -2850,6 +3671,21 @@ class Sigma : public Evaluator {
         return new Sigma(tpos, name, from->clone(NULL), to->clone(NULL), step->clone(NULL), ev->clone(NULL));
     }
 
+    Evaluator *simplify() {
+        from = from->simplify();
+        to = to->simplify();
+        step = step->simplify();
+        ev = ev->simplify();
+        return this;
+    }
+
+    /* When the summand is straight-line arithmetic, the loop keeps the
+     * index on the stack, under the running sum, and the summand PICKs it
+     * from there; see GeneratorContext::pickIndex(). Otherwise, e.g. when
+     * the summand calls a user function or contains another Σ, either of
+     * which could refer to the index by name, it is kept in a local
+     * variable instead. Either way, the loop ends with the same stack.
+     */
     void generateCode(GeneratorContext *ctx) {
         to->generateCode(ctx);
         step->generateCode(ctx);
@@ -2860,6 +3696,37 @@ class Sigma : public Evaluator {
         ctx->addLine(tpos, CMD_XEQL, lbl1);
         ctx->pushSubroutine();
         ctx->addLine(tpos, CMD_LBL, lbl1);
+
+        bool onStack = false;
+        if (ev->isDirect()) {
+            GeneratorContext trial;
+            int begin = trial.lineCount();
+            ev->generateCode(&trial);
+            onStack = trial.pickIndex(begin, name, 2);
+        }
+        if (onStack) {
+            // Stack: to, step, index, sum
+            ctx->addLine(tpos, (phloat) 0);
+            ctx->addLine(tpos, CMD_LBL, lbl2);
+            int begin = ctx->lineCount();
+            ev->generateCode(ctx);
+            ctx->pickIndex(begin, name, 2);
+            ctx->addLine(tpos, CMD_ADD);
+            ctx->addLine(tpos, CMD_SWAP);
+            ctx->addLine(tpos, CMD_RCL_ADD, 'Z');
+            ctx->addLine(tpos, CMD_X_GT_NN, 'T');
+            ctx->addLine(tpos, CMD_GTOL, lbl3);
+            ctx->addLine(tpos, CMD_SWAP);
+            ctx->addLine(tpos, CMD_GTOL, lbl2);
+            ctx->addLine(tpos, CMD_LBL, lbl3);
+            ctx->addLine(tpos, CMD_RDNN, 4);
+            ctx->addLine(tpos, CMD_RDNN, 4);
+            ctx->addLine(tpos, CMD_DROPN, 3);
+            ctx->popSubroutine();
+            return;
+        }
+
+        // Stack: to, step, sum; the index is in a local variable
         ctx->addLine(tpos, CMD_LSTO, name);
         ctx->addLine(tpos, CMD_DROP);
         ctx->addLine(tpos, (phloat) 0);
@@ -2880,6 +3747,69 @@ class Sigma : public Evaluator {
         ctx->popSubroutine();
     }
 
+    bool isDirect() {
+        return from->isDirect() && to->isDirect() && step->isDirect() && ev->isDirect();
+    }
+
+    /* Does what the generated code does, including adding the first term
+     * even if it is past the end, but with the index in direct_indexes
+     * instead of in a local variable. Unlike the generated code, this can't
+     * be interrupted, so it gives up when the sum would take more terms than
+     * are left in direct_terms_left, and the caller then runs the generated
+     * code instead.
+     */
+    int evaluate() {
+        phloat f, t, s;
+        int err = to->evaluate();
+        if (err == ERR_NONE)
+            err = direct_pop_real(&t);
+        if (err == ERR_NONE)
+            err = step->evaluate();
+        if (err == ERR_NONE)
+            err = direct_pop_real(&s);
+        if (err == ERR_NONE)
+            err = from->evaluate();
+        if (err == ERR_NONE)
+            err = direct_pop_real(&f);
+        if (err == ERR_NONE)
+            err = direct_number(0);
+        if (err != ERR_NONE)
+            return err;
+
+        // Give up right away if the terms would not fit in the budget; the
+        // count in the loop catches what rounding gets past this.
+        if (f <= t && (s <= 0 || (t - f) / s >= direct_terms_left))
+            return ERR_INTERRUPTED;
+
+        // Nested loops push their own indexes, which may move this one
+        int k = direct_indexes.size();
+        direct_index di;
+        di.name = &name;
+        di.value = f;
+        direct_indexes.push_back(di);
+        while (true) {
+            if (--direct_terms_left < 0) {
+                err = ERR_INTERRUPTED;
+                break;
+            }
+            err = ev->evaluate();
+            if (err == ERR_NONE)
+                err = direct_command(CMD_ADD);
+            if (err != ERR_NONE)
+                break;
+            phloat i = direct_indexes[k].value + s;
+            if (p_isinf(i)) {
+                err = ERR_OUT_OF_RANGE;
+                break;
+            }
+            if (i > t)
+                break;
+            direct_indexes[k].value = i;
+        }
+        direct_indexes.pop_back();
+        return err;
+    }
+
     void collectVariables(std::vector<std::string> *vars, std::vector<std::string> *locals) {
         locals->push_back(name);
         from->collectVariables(vars, locals);
@@ -2917,11 +3847,14 @@ class Sin : public UnaryEvaluator {
     }
 
     Evaluator *invert(const std::string &name, Evaluator *rhs);
+    Evaluator *derivativeOfFunction();
 
     void generateCode(GeneratorContext *ctx) {
         ev->generateCode(ctx);
         ctx->addLine(tpos, CMD_SIN);
     }
+
+    int directCmd() { return CMD_SIN; }
 };
 
 //////////////////
@@ -2939,11 +3872,14 @@ class Sinh : public UnaryEvaluator {
     }
 
     Evaluator *invert(const std::string &name, Evaluator *rhs);
+    Evaluator *derivativeOfFunction();
 
     void generateCode(GeneratorContext *ctx) {
         ev->generateCode(ctx);
         ctx->addLine(tpos, CMD_SINH);
     }
+
+    int directCmd() { return CMD_SINH; }
 };
 
 //////////////////
@@ -3001,11 +3937,14 @@ class Sq : public UnaryEvaluator {
     }
 
     Evaluator *invert(const std::string &name, Evaluator *rhs);
+    Evaluator *derivativeOfFunction();
 
     void generateCode(GeneratorContext *ctx) {
         ev->generateCode(ctx);
         ctx->addLine(tpos, CMD_SQUARE);
     }
+
+    int directCmd() { return CMD_SQUARE; }
 };
 
 //////////////////
@@ -3023,11 +3962,14 @@ class Sqrt : public UnaryEvaluator {
     }
 
     Evaluator *invert(const std::string &name, Evaluator *rhs);
+    Evaluator *derivativeOfFunction();
 
     void generateCode(GeneratorContext *ctx) {
         ev->generateCode(ctx);
         ctx->addLine(tpos, CMD_SQRT);
     }
+
+    int directCmd() { return CMD_SQRT; }
 };
 
 /////////////////////
@@ -3120,12 +4062,15 @@ class Sum : public BinaryEvaluator {
     }
 
     Evaluator *invert(const std::string &name, Evaluator *rhs);
+    Evaluator *derivativeOfOperation(Evaluator *dl, Evaluator *dr);
 
     void generateCode(GeneratorContext *ctx) {
         left->generateCode(ctx);
         right->generateCode(ctx);
         ctx->addLine(tpos, CMD_ADD);
     }
+
+    int directCmd() { return CMD_ADD; }
 };
 
 /////////////////
@@ -3143,11 +4088,14 @@ class Tan : public UnaryEvaluator {
     }
 
     Evaluator *invert(const std::string &name, Evaluator *rhs);
+    Evaluator *derivativeOfFunction();
 
     void generateCode(GeneratorContext *ctx) {
         ev->generateCode(ctx);
         ctx->addLine(tpos, CMD_TAN);
     }
+
+    int directCmd() { return CMD_TAN; }
 };
 
 //////////////////
@@ -3165,11 +4113,14 @@ class Tanh : public UnaryEvaluator {
     }
 
     Evaluator *invert(const std::string &name, Evaluator *rhs);
+    Evaluator *derivativeOfFunction();
 
     void generateCode(GeneratorContext *ctx) {
         ev->generateCode(ctx);
         ctx->addLine(tpos, CMD_TANH);
     }
+
+    int directCmd() { return CMD_TANH; }
 };
 
 //////////////////////
@@ -3230,6 +4181,8 @@ class UnaryFunction : public UnaryEvaluator {
         ev->generateCode(ctx);
         ctx->addLine(tpos, cmd);
     }
+
+    int directCmd() { return cmd; }
 };
 
 //////////////////////
@@ -3253,11 +4206,37 @@ class Variable : public Evaluator {
     std::string name() { return nam; }
 
     Evaluator *invert(const std::string &name, Evaluator *rhs);
+    Evaluator *derivative(const std::string &name);
 
     void generateCode(GeneratorContext *ctx) {
         ctx->addLine(tpos, CMD_RCL, nam);
     }
 
+    bool isDirect() { return true; }
+
+    int evaluate() {
+        // Names are compared the way the generated code would, which
+        // truncates them to 7 characters
+        for (int i = direct_indexes.size() - 1; i >= 0; i--)
+            if (nam.compare(0, 7, *direct_indexes[i].name, 0, 7) == 0)
+                return direct_number(direct_indexes[i].value);
+        // Only numbers: matrix operations may need to be interruptible,
+        // which only works when running generated code.
+        arg_struct arg;
+        int len = nam.length();
+        if (len > 7)
+            len = 7;
+        vartype *v = recall_var(nam.c_str(), len);
+        if (v == NULL)
+            return ERR_NONEXISTENT;
+        if (v->type != TYPE_REAL && v->type != TYPE_COMPLEX)
+            return ERR_INVALID_TYPE;
+        arg.type = ARGTYPE_STR;
+        memcpy(arg.val.text, nam.c_str(), len);
+        arg.length = len;
+        return direct_command(CMD_RCL, &arg);
+    }
+
     void collectVariables(std::vector<std::string> *vars, std::vector<std::string> *locals) {
         addIfNew(nam, vars, locals);
     }
@@ -3382,6 +4361,8 @@ class Xor : public BinaryEvaluator {
         right->generateCode(ctx);
         ctx->addLine(tpos, CMD_GEN_XOR);
     }
+
+    int directCmd() { return CMD_GEN_XOR; }
 };
 
 ////////////////////
@@ -3422,6 +4403,184 @@ class Ycoord : public BinaryEvaluator {
     }
 };
 
+/* Constant folding and identity removal
+ *
+ * Constant subtrees are folded only when they consist of numbers and of
+ * functions whose real results don't depend on any flags. They are evaluated
+ * by the same command handlers the generated code would use, so the folded
+ * value is exactly what the equation would have produced at run time.
+ * Subtrees that fail, or that don't produce a real number, are left alone,
+ * so their errors and complex results still happen when the equation runs.
+ *
+ * Identities are removed only when the operand is known to be a number or a
+ * numeric matrix, i.e. something the operation would have accepted and
+ * returned unchanged: x*1, 1*x, x/1, x-0, and --x. Note that x+0 is not an
+ * identity, since it turns -0 into 0.
+ */
+
+static bool foldable(int cmd) {
+    switch (cmd) {
+        case CMD_ADD:
+        case CMD_SUB:
+        case CMD_MUL:
+        case CMD_DIV:
+        case CMD_CHS:
+        case CMD_SQUARE:
+        case CMD_INV:
+        case CMD_SQRT:
+        case CMD_Y_POW_X:
+        case CMD_E_POW_X:
+        case CMD_E_POW_X_1:
+        case CMD_10_POW_X:
+        case CMD_LN:
+        case CMD_LN_1_X:
+        case CMD_LOG:
+        case CMD_SINH:
+        case CMD_COSH:
+        case CMD_TANH:
+        case CMD_ABS:
+        case CMD_IP:
+        case CMD_FP:
+        case CMD_MOD:
+        case CMD_COMB:
+        case CMD_PERM:
+        case CMD_FACT:
+        case CMD_GAMMA:
+            return true;
+        default:
+            return false;
+    }
+}
+
+/* Evaluates a constant subtree. This uses a stack of its own, since equations
+ * are also parsed while loading state, when the stack may not exist yet.
+ */
+static bool fold_constant(Evaluator *ev, phloat *value) {
+    vartype **saved_stack_buffer = stack_buffer;
+    vartype **saved_stack = stack;
+    int saved_stack_capacity = stack_capacity;
+    int saved_sp = sp;
+    vartype *saved_lastx = lastx;
+    flags_struct saved_flags = flags;
+    stack_buffer = NULL;
+    stack = NULL;
+    stack_capacity = 0;
+    sp = -1;
+    lastx = NULL;
+    flags.f.big_stack = 1;
+    flags.f.trace_print = 0;
+    flags.f.normal_print = 0;
+    flags.f.range_error_ignore = 0;
+    flags.f.real_result_only = 0;
+
+    bool success = ev->evaluate() == ERR_NONE
+                    && sp == 0 && stack[0]->type == TYPE_REAL;
+    if (success)
+        *value = ((vartype_real *) stack[0])->x;
+
+    while (sp >= 0)
+        free_vartype(stack[sp--]);
+    free_stack();
+    free_vartype(lastx);
+    stack_buffer = saved_stack_buffer;
+    stack = saved_stack;
+    stack_capacity = saved_stack_capacity;
+    sp = saved_sp;
+    lastx = saved_lastx;
+    flags = saved_flags;
+    return success;
+}
+
+static bool is_one(Evaluator *ev) {
+    phloat value;
+    return ev->getLiteral(&value) && value == 1;
+}
+
+static bool is_positive_zero(Evaluator *ev) {
+    phloat value;
+    return ev->getLiteral(&value) && value == 0 && 1 / value > 0;
+}
+
+Evaluator *UnaryEvaluator::simplify() {
+    ev = ev->simplify();
+    phloat value;
+    if (!foldable(directCmd()) || !ev->getLiteral(&value)
+            || !fold_constant(this, &value))
+        return this;
+    Evaluator *res = new Literal(tpos, value);
+    delete this;
+    return res;
+}
+
+bool UnaryEvaluator::isNumeric() {
+    // Functions that only accept numbers and numeric matrices
+    int cmd = directCmd();
+    return foldable(cmd) && (cmd_array[cmd].rttypes & ~0x0f) == 0;
+}
+
+Evaluator *BinaryEvaluator::simplify() {
+    simplifyArgs();
+    phloat value;
+    if (!foldable(directCmd()) || !left->getLiteral(&value)
+            || !right->getLiteral(&value) || !fold_constant(this, &value))
+        return this;
+    Evaluator *res = new Literal(tpos, value);
+    delete this;
+    return res;
+}
+
+bool BinaryEvaluator::isNumeric() {
+    // See UnaryEvaluator::isNumeric()
+    int cmd = directCmd();
+    return foldable(cmd) && (cmd_array[cmd].rttypes & ~0x0f) == 0;
+}
+
+Evaluator *Difference::simplify() {
+    Evaluator *res = BinaryEvaluator::simplify();
+    if (res == this && !swapArgs && is_positive_zero(right) && left->isNumeric())
+        res = replaceByLeft();
+    return res;
+}
+
+Evaluator *Negative::simplify() {
+    Evaluator *res = UnaryEvaluator::simplify();
+    if (res != this || !ev->isNegative())
+        return res;
+    Negative *inner = (Negative *) ev;
+    if (!inner->ev->isNumeric())
+        return this;
+    res = inner->ev;
+    inner->ev = NULL;
+    delete this;
+    return res;
+}
+
+Evaluator *Product::simplify() {
+    Evaluator *res = BinaryEvaluator::simplify();
+    if (res != this)
+        return res;
+    if (is_one(right) && left->isNumeric())
+        return replaceByLeft();
+    if (is_one(left) && right->isNumeric())
+        return replaceByRight();
+    return this;
+}
+
+Evaluator *Quotient::simplify() {
+    Evaluator *res = BinaryEvaluator::simplify();
+    if (res == this && !swapArgs && is_one(right) && left->isNumeric())
+        res = replaceByLeft();
+    return res;
+}
+
+Evaluator *RecallFunction::simplify() {
+    if (cmd != CMD_PI)
+        return this;
+    Evaluator *res = new Literal(tpos, PI);
+    delete this;
+    return res;
+}
+
 /* Methods that can't be defined in their class declarations
  * because they reference other Evaluator classes 
  *
@@ -3677,6 +4836,266 @@ Evaluator *Variable::invert(const std::string &name, Evaluator *rhs) {
     }
 }
 
+/* Symbolic differentiation, for Newton steps in SOLVE.
+ *
+ * derivative() returns a new tree for the derivative of this one with respect
+ * to the named variable, or NULL if it doesn't know how. It is only used on
+ * trees that can be evaluated directly (see isDirect()), where every variable
+ * an expression depends on appears in it, so anything that doesn't mention
+ * the variable at all has derivative 0. The results are built from directly
+ * evaluable nodes as well, since that's how the solver evaluates them.
+ * The trigonometric functions are differentiated in whatever angle mode is
+ * active when the derivative is evaluated: the factor pi/ACOS(-1) is 1 in
+ * RAD mode, pi/180 in DEG mode, and pi/200 in GRAD mode.
+ */
+
+static bool is_zero(Evaluator *ev) {
+    phloat value;
+    return ev->getLiteral(&value) && value == 0;
+}
+
+static Evaluator *d_sum(Evaluator *a, Evaluator *b) {
+    if (is_zero(a)) {
+        delete a;
+        return b;
+    }
+    if (is_zero(b)) {
+        delete b;
+        return a;
+    }
+    return new Sum(0, a, b);
+}
+
+static Evaluator *d_difference(Evaluator *a, Evaluator *b) {
+    if (is_zero(b)) {
+        delete b;
+        return a;
+    }
+    if (is_zero(a)) {
+        delete a;
+        return new Negative(0, b);
+    }
+    return new Difference(0, a, b);
+}
+
+static Evaluator *d_product(Evaluator *a, Evaluator *b) {
+    if (is_zero(a) || is_zero(b)) {
+        delete a;
+        delete b;
+        return new Literal(0, 0);
+    }
+    if (is_one(a)) {
+        delete a;
+        return b;
+    }
+    if (is_one(b)) {
+        delete b;
+        return a;
+    }
+    return new Product(0, a, b);
+}
+
+static Evaluator *d_quotient(Evaluator *a, Evaluator *b) {
+    if (is_zero(a)) {
+        delete a;
+        delete b;
+        return new Literal(0, 0);
+    }
+    return new Quotient(0, a, b);
+}
+
+static Evaluator *angle_factor() {
+    return new Quotient(0, new Literal(0, PI), new Acos(0, new Literal(0, -1)));
+}
+
+/* Chain rule for functions of one argument: f(u)' = df * u'. Takes ownership
+ * of df; returns NULL, and deletes df, if u' can't be found.
+ */
+static Evaluator *chain(Evaluator *df, Evaluator *u, const std::string &name) {
+    Evaluator *du = u->derivative(name);
+    if (du == NULL) {
+        delete df;
+        return NULL;
+    }
+    return d_product(df, du);
+}
+
+Evaluator *Evaluator::derivative(const std::string &name) {
+    return howMany(name) == 0 ? new Literal(tpos, 0) : NULL;
+}
+
+Evaluator *UnaryEvaluator::derivative(const std::string &name) {
+    if (ev->howMany(name) == 0)
+        return new Literal(tpos, 0);
+    Evaluator *df = derivativeOfFunction();
+    if (df == NULL)
+        return NULL;
+    return chain(df, ev, name);
+}
+
+Evaluator *BinaryEvaluator::derivative(const std::string &name) {
+    if (right == NULL)
+        return NULL;
+    if (left->howMany(name) == 0 && right->howMany(name) == 0)
+        return new Literal(tpos, 0);
+    Evaluator *dl = left->derivative(name);
+    if (dl == NULL)
+        return NULL;
+    Evaluator *dr = right->derivative(name);
+    if (dr == NULL) {
+        delete dl;
+        return NULL;
+    }
+    Evaluator *res = derivativeOfOperation(dl, dr);
+    if (res == NULL) {
+        delete dl;
+        delete dr;
+    }
+    return res;
+}
+
+Evaluator *Variable::derivative(const std::string &name) {
+    return new Literal(tpos, nam == name ? 1 : 0);
+}
+
+Evaluator *NameTag::derivative(const std::string &name) {
+    return ev->derivative(name);
+}
+
+Evaluator *Acos::derivativeOfFunction() {
+    // -1/sqrt(1-u^2), in the current angle mode
+    return new Negative(0, new Quotient(0, new Inv(0, new Sqrt(0, new Difference(0, new Literal(0, 1), new Sq(0, ev->clone(NULL))))), angle_factor()));
+}
+
+Evaluator *Acosh::derivativeOfFunction() {
+    return new Inv(0, new Sqrt(0, new Difference(0, new Sq(0, ev->clone(NULL)), new Literal(0, 1))));
+}
+
+Evaluator *Alog::derivativeOfFunction() {
+    return new Product(0, new Alog(0, ev->clone(NULL)), new Ln(0, new Literal(0, 10)));
+}
+
+Evaluator *Asin::derivativeOfFunction() {
+    return new Quotient(0, new Inv(0, new Sqrt(0, new Difference(0, new Literal(0, 1), new Sq(0, ev->clone(NULL))))), angle_factor());
+}
+
+Evaluator *Asinh::derivativeOfFunction() {
+    return new Inv(0, new Sqrt(0, new Sum(0, new Sq(0, ev->clone(NULL)), new Literal(0, 1))));
+}
+
+Evaluator *Atan::derivativeOfFunction() {
+    return new Quotient(0, new Inv(0, new Sum(0, new Literal(0, 1), new Sq(0, ev->clone(NULL)))), angle_factor());
+}
+
+Evaluator *Atanh::derivativeOfFunction() {
+    return new Inv(0, new Difference(0, new Literal(0, 1), new Sq(0, ev->clone(NULL))));
+}
+
+Evaluator *Cos::derivativeOfFunction() {
+    return new Negative(0, new Product(0, new Sin(0, ev->clone(NULL)), angle_factor()));
+}
+
+Evaluator *Cosh::derivativeOfFunction() {
+    return new Sinh(0, ev->clone(NULL));
+}
+
+Evaluator *Exp::derivativeOfFunction() {
+    return new Exp(0, ev->clone(NULL));
+}
+
+Evaluator *Expm1::derivativeOfFunction() {
+    return new Exp(0, ev->clone(NULL));
+}
+
+Evaluator *Inv::derivativeOfFunction() {
+    return new Negative(0, new Inv(0, new Sq(0, ev->clone(NULL))));
+}
+
+Evaluator *Ln::derivativeOfFunction() {
+    return new Inv(0, ev->clone(NULL));
+}
+
+Evaluator *Ln1p::derivativeOfFunction() {
+    return new Inv(0, new Sum(0, new Literal(0, 1), ev->clone(NULL)));
+}
+
+Evaluator *Log::derivativeOfFunction() {
+    return new Inv(0, new Product(0, ev->clone(NULL), new Ln(0, new Literal(0, 10))));
+}
+
+Evaluator *Negative::derivativeOfFunction() {
+    return new Literal(0, -1);
+}
+
+Evaluator *Sin::derivativeOfFunction() {
+    return new Product(0, new Cos(0, ev->clone(NULL)), angle_factor());
+}
+
+Evaluator *Sinh::derivativeOfFunction() {
+    return new Cosh(0, ev->clone(NULL));
+}
+
+Evaluator *Sq::derivativeOfFunction() {
+    return new Product(0, new Literal(0, 2), ev->clone(NULL));
+}
+
+Evaluator *Sqrt::derivativeOfFunction() {
+    return new Inv(0, new Product(0, new Literal(0, 2), new Sqrt(0, ev->clone(NULL))));
+}
+
+Evaluator *Tan::derivativeOfFunction() {
+    return new Quotient(0, angle_factor(), new Sq(0, new Cos(0, ev->clone(NULL))));
+}
+
+Evaluator *Tanh::derivativeOfFunction() {
+    return new Inv(0, new Sq(0, new Cosh(0, ev->clone(NULL))));
+}
+
+Evaluator *Difference::derivativeOfOperation(Evaluator *dl, Evaluator *dr) {
+    if (swapArgs)
+        return d_difference(dr, dl);
+    else
+        return d_difference(dl, dr);
+}
+
+Evaluator *Equation::derivativeOfOperation(Evaluator *dl, Evaluator *dr) {
+    return d_difference(dl, dr);
+}
+
+Evaluator *Power::derivativeOfOperation(Evaluator *dl, Evaluator *dr) {
+    Evaluator *base = swapArgs ? right : left;
+    Evaluator *exp = swapArgs ? left : right;
+    Evaluator *dbase = swapArgs ? dr : dl;
+    Evaluator *dexp = swapArgs ? dl : dr;
+    if (is_zero(dexp)) {
+        // b * a^(b-1) * a'
+        delete dexp;
+        Evaluator *df = new Product(0, exp->clone(NULL), new Power(0, base->clone(NULL), new Difference(0, exp->clone(NULL), new Literal(0, 1))));
+        return d_product(df, dbase);
+    }
+    // a^b * (b' * ln(a) + b * a' / a)
+    Evaluator *t1 = d_product(dexp, new Ln(0, base->clone(NULL)));
+    Evaluator *t2 = d_quotient(d_product(exp->clone(NULL), dbase), base->clone(NULL));
+    return d_product(new Power(0, base->clone(NULL), exp->clone(NULL)), d_sum(t1, t2));
+}
+
+Evaluator *Product::derivativeOfOperation(Evaluator *dl, Evaluator *dr) {
+    return d_sum(d_product(dl, right->clone(NULL)), d_product(left->clone(NULL), dr));
+}
+
+Evaluator *Quotient::derivativeOfOperation(Evaluator *dl, Evaluator *dr) {
+    Evaluator *num = swapArgs ? right : left;
+    Evaluator *den = swapArgs ? left : right;
+    Evaluator *dnum = swapArgs ? dr : dl;
+    Evaluator *dden = swapArgs ? dl : dr;
+    // (a' * b - a * b') / b^2
+    return d_quotient(d_difference(d_product(dnum, den->clone(NULL)), d_product(num->clone(NULL), dden)), new Sq(0, den->clone(NULL)));
+}
+
+Evaluator *Sum::derivativeOfOperation(Evaluator *dl, Evaluator *dr) {
+    return d_sum(dl, dr);
+}
+
 
 void Break::generateCode(GeneratorContext *ctx) {
     if (f == NULL)
@@ -3697,6 +5116,10 @@ void Evaluator::getSides(const std::string &name, Evaluator **lhs, Evaluator **r
     *rhs = NULL;
 }
 
+int Evaluator::evaluate() {
+    return ERR_INTERNAL_ERROR;
+}
+
 void Evaluator::addIfNew(const std::string &name, std::vector<std::string> *vars, std::vector<std::string> *locals) {
     for (int i = 0; i < locals->size(); i++)
         if ((*locals)[i] == name)
@@ -3905,51 +5328,64 @@ class Lexer {
 #define CTX_BOOLEAN 2
 #define CTX_ARRAY 3
 
-/* static */ Evaluator *Parser::parse(std::string expr, bool compatMode, int *errpos) {
-    std::string t, t2, eqnName;
-    std::vector<std::string> *paramNames = new std::vector<std::string>;
+/* static */ bool Parser::scanName(Lexer *lex, std::string *eqnName, std::vector<std::string> *paramNames) {
+    std::string t, t2;
     int tpos;
-    
-    // Look for equation name
-    Lexer *lex = new Lexer(expr, compatMode);
+
     if (!lex->nextToken(&t, &tpos))
-        goto no_name;
+        return false;
     if (!lex->isIdentifier(t))
-        goto no_name;
+        return false;
     if (!lex->nextToken(&t2, &tpos))
-        goto no_name;
+        return false;
     if (t2 != ":" && t2 != "(")
-        goto no_name;
+        return false;
     if (t2 == "(") {
         while (true) {
             if (!lex->nextToken(&t2, &tpos))
-                goto no_name;
+                return false;
             if (!lex->isIdentifier(t2))
-                goto no_name;
+                return false;
             paramNames->push_back(t2);
             if (!lex->nextToken(&t2, &tpos))
-                goto no_name;
+                return false;
             if (t2 == ":")
                 continue;
             else if (t2 == ")") {
                 if (!lex->nextToken(&t2, &tpos))
-                    goto no_name;
+                    return false;
                 if (t2 == ":")
                     break;
                 else
-                    goto no_name;
+                    return false;
             } else
-                goto no_name;
+                return false;
         }
     }
+    *eqnName = t;
+    return true;
+}
 
-    eqnName = t;
-    goto name_done;
-    no_name:
-    lex->reset();
-    delete paramNames;
-    paramNames = NULL;
-    name_done:
+/* static */ std::string Parser::parseName(std::string expr, bool compatMode) {
+    Lexer lex(expr, compatMode);
+    std::string eqnName;
+    std::vector<std::string> paramNames;
+    scanName(&lex, &eqnName, &paramNames);
+    return eqnName;
+}
+
+/* static */ Evaluator *Parser::parse(std::string expr, bool compatMode, int *errpos) {
+    std::string t, eqnName;
+    std::vector<std::string> *paramNames = new std::vector<std::string>;
+    int tpos;
+    
+    // Look for equation name
+    Lexer *lex = new Lexer(expr, compatMode);
+    if (!scanName(lex, &eqnName, paramNames)) {
+        lex->reset();
+        delete paramNames;
+        paramNames = NULL;
+    }
     
     Parser pz(lex);
     Evaluator *ev = pz.parseExpr(CTX_TOP);
@@ -3964,6 +5400,7 @@ class Lexer {
     }
     if (t == "") {
         // Text consumed completely; this is the good scenario
+        ev = ev->simplify();
         if (eqnName != "")
             ev = new NameTag(0, eqnName, paramNames, ev);
         return ev;
@@ -3975,10 +5412,12 @@ class Lexer {
     }
 }
 
-/* static */ void Parser::generateCode(Evaluator *ev, prgm_struct *prgm, CodeMap *map) {
+/* static */ bool Parser::generateCode(Evaluator *ev, prgm_struct *prgm, CodeMap *map) {
     GeneratorContext ctx;
     ev->generateCode(&ctx);
-    ctx.store(prgm, map);
+    if (ev->isDirect())
+        ctx.eliminateCommonSubexpressions();
+    return ctx.store(prgm, map);
 }
 
 Parser::Parser(Lexer *lex) : lex(lex), pbpos(-1) {}
@@ -4958,7 +6397,7 @@ void Parser::pushback(std::string o, int p) {
 }
 
 void get_varmenu_row_for_eqn(vartype *eqn, int *rows, int *row, char ktext[6][7], int klen[6]) {
-    Evaluator *ev = prgms[((vartype_equation *) eqn)->data.index()].eq_data->ev;
+    Evaluator *ev = prgms[((vartype_equation *) eqn)->data.index()].eq_data->get_ev();
     std::vector<std::string> vars;
     std::vector<std::string> locals;
     ev->collectVariables(&vars, &locals);
@@ -4986,7 +6425,7 @@ int isolate(vartype *eqn, const char *name, int length) {
         return -1;
     vartype_equation *eq = (vartype_equation *) eqn;
     equation_data *eqd = prgms[eq->data.index()].eq_data;
-    Evaluator *ev = eqd->ev;
+    Evaluator *ev = eqd->get_ev();
     std::string n(name, length);
     if (ev->howMany(n) != 1)
         return -1;
@@ -5018,21 +6457,26 @@ int isolate(vartype *eqn, const char *name, int length) {
     // object would be deleted. Of course I could also return a pgm_index object,
     // that would be cleaner...
     neqd->refcount++;
-    ctx.store(prgms + neq + prgms_count, NULL);
+    bool stored = ctx.store(prgms + neq + prgms_count, NULL);
     neqd->refcount--;
     delete ev;
+    if (!stored) {
+        prgms[neq + prgms_count].eq_data = NULL;
+        delete neqd;
+        return -1;
+    }
     return neq;
 }
 
 bool has_parameters(equation_data *eqdata) {
     std::vector<std::string> names, locals;
-    eqdata->ev->collectVariables(&names, &locals);
+    eqdata->get_ev()->collectVariables(&names, &locals);
     return names.size() > 0;
 }
 
 std::vector<std::string> get_parameters(equation_data *eqdata) {
     std::vector<std::string> names, locals;
-    eqdata->ev->collectVariables(&names, &locals);
+    eqdata->get_ev()->collectVariables(&names, &locals);
     return names;
 }
 
@@ -5059,3 +6503,108 @@ std::vector<std::string> get_mvars(const char *name, int namelen) {
     current_prgm = saved_prgm;
     return names;
 }
+
+/* Evaluates a directly evaluable tree, leaving the stack, LASTX, and the
+ * stack mode as they were. On success, returns the result in *res.
+ */
+static int evaluate_tree(Evaluator *ev, vartype **res) {
+    int saved_sp = sp;
+    char saved_big_stack = flags.f.big_stack;
+    vartype *saved_lastx = lastx;
+    lastx = NULL;
+    // LNSTK, as in the generated code
+    flags.f.big_stack = 1;
+    direct_terms_left = MAX_DIRECT_TERMS;
+
+    int err = ev->evaluate();
+    *res = NULL;
+    if (err == ERR_NONE)
+        *res = stack[sp--];
+    while (sp > saved_sp)
+        free_vartype(stack[sp--]);
+    free_vartype(lastx);
+    lastx = saved_lastx;
+    flags.f.big_stack = saved_big_stack;
+    return err;
+}
+
+/* Evaluates an equation by walking its parse tree and calling the command
+ * handlers directly, instead of running its generated code. This avoids the
+ * FUNC and LNSTK framing, the return stack, and the interpreter loop, which
+ * for simple formulas cost more than the arithmetic itself.
+ * Only equations made up of numbers, variables, functions that compile
+ * to a single command, and Σ sums of those are evaluated this way, and only
+ * when trace printing is off, since that would print the generated code as
+ * it runs.
+ * On success, the result is pushed onto the stack the way FUNC 01 would:
+ * with stack lift, and with LASTX unchanged. On failure, the stack and LASTX
+ * are left as they were, and the caller should run the generated code, which
+ * will then report the error the usual way.
+ */
+bool evaluate_directly(equation_data *eqdata) {
+    if (eqdata->direct == -1)
+        eqdata->direct = eqdata->get_ev()->isDirect();
+    if (!eqdata->direct || flags.f.trace_print && flags.f.printer_exists)
+        return false;
+
+    char saved_stack_lift_disable = flags.f.stack_lift_disable;
+    vartype *res;
+    if (evaluate_tree(eqdata->ev, &res) != ERR_NONE) {
+        flags.f.stack_lift_disable = saved_stack_lift_disable;
+        return false;
+    }
+    flags.f.stack_lift_disable = 0;
+    return recall_result_silently(res) == ERR_NONE;
+}
+
+/* The most recently used derivative. It is rebuilt when it is asked for a
+ * different equation or variable, or when equations have been created or
+ * deleted since, which covers an equation_data being deleted and another
+ * one allocated at the same address.
+ */
+static equation_data *deriv_eqdata = NULL;
+static std::string deriv_name;
+static uint4 deriv_generation;
+static Evaluator *deriv_ev = NULL;
+
+bool evaluate_derivative(equation_data *eqdata, const char *name, int length, phloat *result) {
+    std::string n(name, length);
+    if (eqdata != deriv_eqdata || n != deriv_name || eqn_generation != deriv_generation) {
+        delete deriv_ev;
+        deriv_ev = NULL;
+        deriv_eqdata = eqdata;
+        deriv_name = n;
+        deriv_generation = eqn_generation;
+        if (eqdata->direct == -1)
+            eqdata->direct = eqdata->get_ev()->isDirect();
+        if (eqdata->direct) {
+            deriv_ev = eqdata->ev->derivative(n);
+            if (deriv_ev != NULL)
+                deriv_ev = deriv_ev->simplify();
+        }
+    }
+    if (deriv_ev == NULL)
+        return false;
+
+    char saved_stack_lift_disable = flags.f.stack_lift_disable;
+    vartype *res;
+    int err = evaluate_tree(deriv_ev, &res);
+    flags.f.stack_lift_disable = saved_stack_lift_disable;
+    if (err != ERR_NONE)
+        return false;
+    bool real = res->type == TYPE_REAL;
+    if (real)
+        *result = ((vartype_real *) res)->x;
+    free_vartype(res);
+    return real;
+}
+
+void get_equation_code_stats(int4 *generated, int4 *stored) {
+    *generated = lines_generated;
+    *stored = lines_stored;
+}
+
+void clear_equation_code_stats() {
+    lines_generated = 0;
+    lines_stored = 0;
+}
@@ -59,6 +59,24 @@ class Evaluator {
     virtual void generateAssignmentCode(GeneratorContext *ctx) {} /* For lvalues */
     virtual void collectVariables(std::vector<std::string> *vars, std::vector<std::string> *locals) = 0;
     virtual int howMany(const std::string &name) = 0;
+
+    /* Constant folding and identity removal, done once after parsing.
+     * Returns the simplified node; if that is not this node, this node
+     * has been deleted.
+     */
+    virtual Evaluator *simplify() { return this; }
+    virtual bool getLiteral(phloat *value) { return false; }
+    virtual bool isNumeric() { return false; }
+    virtual bool isNegative() { return false; }
+
+    /* Symbolic derivative with respect to a variable, for Newton steps in
+     * SOLVE; returns a new tree, or NULL if not known.
+     */
+    virtual Evaluator *derivative(const std::string &name);
+
+    /* Direct evaluation; see evaluate_directly() */
+    virtual bool isDirect() { return false; }
+    virtual int evaluate();
     
     void addIfNew(const std::string &name, std::vector<std::string> *vars, std::vector<std::string> *locals);
 };
@@ -70,15 +88,22 @@ class CodeMap {
     int capacity;
     int4 current_pos;
     int4 current_line;
+    // Decoded on the first lookup: for each entry, the line after the last
+    // one it covers, and its position, so lookup() can do a binary search
+    int4 *index_lines;
+    int4 *index_pos;
+    int index_count;
     
     void addByte(int b);
     void write(int4 n);
     int4 read(int *index);
+    void clearIndex();
+    bool buildIndex();
     
     public:
-    CodeMap() : data(NULL), size(0), capacity(0), current_pos(-1), current_line(0) {}
-    CodeMap(char *data, int size) : data(data), size(size) {}
-    ~CodeMap() { delete data; }
+    CodeMap() : data(NULL), size(0), capacity(0), current_pos(-1), current_line(0), index_lines(NULL), index_pos(NULL), index_count(-1) {}
+    CodeMap(char *data, int size) : data(data), size(size), index_lines(NULL), index_pos(NULL), index_count(-1) {}
+    ~CodeMap() { delete data; clearIndex(); }
     void add(int4 pos, int4 line);
     int4 lookup(int4 line);
     char *getData() { return data; }
@@ -102,12 +127,16 @@ class Parser {
     public:
 
     static Evaluator *parse(std::string expr, bool compatMode, int *errpos);
-    static void generateCode(Evaluator *ev, prgm_struct *prgm, CodeMap *map);
+    // The equation's name, as parse() would find it, without parsing the rest
+    static std::string parseName(std::string expr, bool compatMode);
+    // Returns false if there wasn't enough memory to generate the code
+    static bool generateCode(Evaluator *ev, prgm_struct *prgm, CodeMap *map);
 
     private:
 
     Parser(Lexer *lex);
     ~Parser();
+    static bool scanName(Lexer *lex, std::string *eqnName, std::vector<std::string> *paramNames);
     Evaluator *parseExpr(int context);
     Evaluator *parseExpr2();
     Evaluator *parseAnd();
@@ -129,5 +158,18 @@ int isolate(vartype *eqn, const char *name, int length);
 bool has_parameters(equation_data *eqdata);
 std::vector<std::string> get_parameters(equation_data *eqdata);
 std::vector<std::string> get_mvars(const char *name, int namelen);
+bool evaluate_directly(equation_data *eqdata);
+/* Evaluates the derivative of an equation with respect to one of its
+ * variables, at the variable's current value, for Newton steps in SOLVE.
+ * Only works for equations that can be evaluated directly; returns false if
+ * the derivative isn't known, or doesn't evaluate to a real number.
+ */
+bool evaluate_derivative(equation_data *eqdata, const char *name, int length, phloat *result);
+
+/* Lines of equation code generated, and stored after optimization, since the
+ * last call to clear_equation_code_stats()
+ */
+void get_equation_code_stats(int4 *generated, int4 *stored);
+void clear_equation_code_stats();
 
 #endif
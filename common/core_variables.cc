@@ -31,6 +31,14 @@ equation_data::~equation_data() {
     delete map;
 }
 
+Evaluator *equation_data::get_ev() {
+    if (ev == NULL) {
+        int errpos;
+        ev = Parser::parse(std::string(text, length), compatMode, &errpos);
+    }
+    return ev;
+}
+
 void pgm_index::inc_refcount() {
     if (uni > 0 && (uni & 1) != 0)
         prgms[(uni >> 1) + prgms_count].eq_data->refcount++;
@@ -46,6 +54,8 @@ void pgm_index::dec_refcount() {
         if (--eqd->refcount == 0) {
             delete eqd;
             prgms[i].eq_data = NULL;
+            eqn_generation++;
+            invalidate_decoded(prgms + i);
         }
     }
 }
@@ -166,6 +176,7 @@ vartype *new_realmatrix(int4 rows, int4 columns) {
     for (i = 0; i < sz; i++)
         rm->array->data[i] = 0;
     memset(rm->array->is_string, 0, sz);
+    rm->array->string_count = 0;
     rm->array->refcount = 1;
     return (vartype *) rm;
 }
@@ -223,7 +234,58 @@ vartype *new_list(int4 size) {
     return (vartype *) list;
 }
 
+/* Recently parsed equations. Parsing the same text again, as happens every
+ * time an integral inside an equation is evaluated, returns the existing
+ * equation, instead of parsing it and generating its code all over again.
+ * Equations never change once they have been created, so sharing them is
+ * safe; dup_vartype() does the same thing.
+ * The cache holds references to the equations, so it is flushed before the
+ * state is saved, and before programs and variables are cleared.
+ */
+#define EQN_CACHE_SIZE 16
+static vartype *eqn_cache[EQN_CACHE_SIZE];
+static int eqn_cache_count = 0;
+
+static vartype *find_cached_equation(const char *text, int4 len, bool compat_mode) {
+    for (int i = 0; i < eqn_cache_count; i++) {
+        vartype *eq = eqn_cache[i];
+        equation_data *eqd = prgms[((vartype_equation *) eq)->data.index()].eq_data;
+        if (eqd->length == len && eqd->compatMode == compat_mode
+                && memcmp(eqd->text, text, len) == 0) {
+            // Most recently used first
+            memmove(eqn_cache + 1, eqn_cache, i * sizeof(vartype *));
+            eqn_cache[0] = eq;
+            return dup_vartype(eq);
+        }
+    }
+    return NULL;
+}
+
+static void cache_equation(vartype *eq) {
+    vartype *copy = dup_vartype(eq);
+    if (copy == NULL)
+        return;
+    if (eqn_cache_count == EQN_CACHE_SIZE)
+        free_vartype(eqn_cache[--eqn_cache_count]);
+    memmove(eqn_cache + 1, eqn_cache, eqn_cache_count * sizeof(vartype *));
+    eqn_cache[0] = copy;
+    eqn_cache_count++;
+}
+
+void flush_equation_cache() {
+    while (eqn_cache_count > 0)
+        free_vartype(eqn_cache[--eqn_cache_count]);
+}
+
 vartype *new_equation(const char *text, int4 len, bool compat_mode, int *errpos, int eqn_index) {
+    bool cacheable = eqn_index == -1;
+    if (cacheable) {
+        vartype *eq = find_cached_equation(text, len, compat_mode);
+        if (eq != NULL) {
+            *errpos = -1;
+            return eq;
+        }
+    }
     eqn_index = new_eqn_idx(eqn_index);
     if (eqn_index == -1)
         return NULL;
@@ -251,12 +313,17 @@ vartype *new_equation(const char *text, int4 len, bool compat_mode, int *errpos,
     eq->type = TYPE_EQUATION;
     eq->data.init_eqn(eqn_index, eqd);
     CodeMap *map = new CodeMap;
-    Parser::generateCode(eqd->ev, prgms + eq->data.index(), map);
+    if (!Parser::generateCode(eqd->ev, prgms + eq->data.index(), map)) {
+        delete map;
+        free_vartype((vartype *) eq);
+        return NULL;
+    }
     if (map->getSize() == -1)
         delete map;
     else
         eqd->map = map;
-    // TODO: Error handling. Have generateCode() signal failure by setting 'text' to NULL or something.
+    if (cacheable)
+        cache_equation((vartype *) eq);
     return (vartype *) eq;
 }
 
@@ -369,7 +436,8 @@ bool put_matrix_string(vartype_realmatrix *rm, int i, const char *text, int4 len
             memcpy(ptext, text, length);
             return true;
         }
-    }
+    } else
+        rm->array->string_count++;
     if (length > SSLENM) {
         int4 *p = (int4 *) malloc(length + 4);
         if (p == NULL)
@@ -493,6 +561,7 @@ int disentangle(vartype *v) {
                         md->data[i] = rm->array->data[i];
                     }
                 }
+                md->string_count = rm->array->string_count;
                 md->refcount = 1;
                 rm->array->refcount--;
                 rm->array = md;
@@ -565,19 +634,161 @@ int disentangle(vartype *v) {
     }
 }
 
-int lookup_var(const char *name, int namelength) {
-    int i, j;
-    for (i = vars_count - 1; i >= 0; i--) {
-        if ((vars[i].flags & (VAR_HIDDEN | VAR_PRIVATE)) != 0)
-            continue;
-        if (vars[i].length == namelength) {
-            for (j = 0; j < namelength; j++)
-                if (vars[i].name[j] != name[j])
-                    goto nomatch;
-            return i;
+/* The variable index maps variable names to their indexes in vars[].
+ * Each bucket is a chain of indexes, linked through var_index_next, in
+ * descending order, so that walking a chain visits the variables with a
+ * given name in the same order as a backward scan of vars[].
+ * Appending to vars[] is absorbed incrementally, by comparing vars_count to
+ * var_index_count. Removing entries from the end must call
+ * truncate_var_index() right away, before anything else is appended, and
+ * any other change to the names or order of vars[] must call
+ * invalidate_var_index(); the index is then rebuilt on the next lookup.
+ * If there isn't enough memory for the index, lookups scan vars[] backward
+ * instead.
+ */
+static bool var_index_valid = false;
+static int var_index_size = 0;
+static int *var_index_buckets = NULL;
+static int var_index_capacity = 0;
+static int var_index_count = 0;
+static int *var_index_next = NULL;
+static int *var_index_bucket = NULL;
+
+void invalidate_var_index() {
+    var_index_valid = false;
+}
+
+void truncate_var_index() {
+    if (!var_index_valid)
+        return;
+    // The removed entries are the highest ones, so they are at the heads
+    // of their chains
+    while (var_index_count > vars_count) {
+        int i = --var_index_count;
+        var_index_buckets[var_index_bucket[i]] = var_index_next[i];
+    }
+}
+
+static void drop_var_index() {
+    free(var_index_buckets);
+    var_index_buckets = NULL;
+    var_index_size = 0;
+    free(var_index_next);
+    var_index_next = NULL;
+    free(var_index_bucket);
+    var_index_bucket = NULL;
+    var_index_capacity = 0;
+    var_index_valid = false;
+}
+
+static void var_index_add(int i) {
+    // remove_locals() marks the entries it is about to drop with length 100
+    int len = vars[i].length <= 7 ? vars[i].length : 0;
+    int h = string_hash(vars[i].name, len) & (var_index_size - 1);
+    var_index_bucket[i] = h;
+    var_index_next[i] = var_index_buckets[h];
+    var_index_buckets[h] = i;
+}
+
+/* Brings the index up to date; returns false if there isn't enough memory
+ * for it.
+ */
+static bool update_var_index() {
+    if (var_index_valid && var_index_count > vars_count)
+        // Truncated without truncate_var_index()
+        var_index_valid = false;
+    if (var_index_valid && var_index_count == vars_count)
+        return true;
+    if (vars_count > var_index_capacity) {
+        int capacity = vars_capacity > vars_count ? vars_capacity : vars_count;
+        int *new_next = (int *) realloc(var_index_next, capacity * sizeof(int));
+        if (new_next == NULL) {
+            drop_var_index();
+            return false;
         }
-        nomatch:;
+        var_index_next = new_next;
+        int *new_bucket = (int *) realloc(var_index_bucket, capacity * sizeof(int));
+        if (new_bucket == NULL) {
+            drop_var_index();
+            return false;
+        }
+        var_index_bucket = new_bucket;
+        var_index_capacity = capacity;
+    }
+    if (var_index_valid && vars_count <= var_index_size) {
+        // Appended: push the new entries onto their chains
+        while (var_index_count < vars_count)
+            var_index_add(var_index_count++);
+        return true;
+    }
+    int size = 16;
+    while (size < vars_count * 2)
+        size <<= 1;
+    if (size != var_index_size) {
+        free(var_index_buckets);
+        var_index_buckets = (int *) malloc(size * sizeof(int));
+        if (var_index_buckets == NULL) {
+            drop_var_index();
+            return false;
+        }
+        var_index_size = size;
     }
+    for (int i = 0; i < size; i++)
+        var_index_buckets[i] = -1;
+    for (int i = 0; i < vars_count; i++)
+        var_index_add(i);
+    var_index_count = vars_count;
+    var_index_valid = true;
+    return true;
+}
+
+/* Returns the last variable before vars[i] with the given name, or -1 */
+static int prev_var_with_name(int i, const char *name, int namelength) {
+    while (--i >= 0)
+        if (string_equals(vars[i].name, vars[i].length, name, namelength))
+            return i;
+    return -1;
+}
+
+/* Returns the head of the index chain for the given name, which may be a
+ * variable with a different name, or, without the index, the last variable
+ * with that name; -1 if there is none.
+ */
+static int first_var_with_name(const char *name, int namelength) {
+    if (!update_var_index())
+        return prev_var_with_name(vars_count, name, namelength);
+    return var_index_buckets[string_hash(name, namelength) & (var_index_size - 1)];
+}
+
+static int next_var_with_name(int i, const char *name, int namelength) {
+    if (!var_index_valid)
+        return prev_var_with_name(i, name, namelength);
+    for (i = var_index_next[i]; i != -1; i = var_index_next[i])
+        if (string_equals(vars[i].name, vars[i].length, name, namelength))
+            return i;
+    return -1;
+}
+
+int lookup_var(const char *name, int namelength) {
+    int i = first_var_with_name(name, namelength);
+    if (i != -1 && !string_equals(vars[i].name, vars[i].length, name, namelength))
+        i = next_var_with_name(i, name, namelength);
+    for (; i != -1; i = next_var_with_name(i, name, namelength))
+        if ((vars[i].flags & (VAR_HIDDEN | VAR_PRIVATE)) == 0)
+            return i;
+    return -1;
+}
+
+int find_hidden_var(int varindex) {
+    /* Returns the index of the variable hidden by vars[varindex], i.e. the
+     * last hidden variable with the same name before it, or -1 if none.
+     */
+    update_var_index();
+    const char *name = vars[varindex].name;
+    int namelength = vars[varindex].length;
+    for (int i = next_var_with_name(varindex, name, namelength); i != -1; i = next_var_with_name(i, name, namelength))
+        if ((vars[i].flags & VAR_HIDDEN) != 0)
+            return i;
     return -1;
 }
 
@@ -590,19 +801,15 @@ vartype *recall_var(const char *name, int namelength) {
 }
 
 static int lookup_global_var(const char *name, int namelength) {
-    int i, j;
-    for (i = 0; i < vars_count; i++) {
-        if (vars[i].level != -1)
-            continue;
-        if (vars[i].length == namelength) {
-            for (j = 0; j < namelength; j++)
-                if (vars[i].name[j] != name[j])
-                    goto nomatch;
-            return i;
-        }
-        nomatch:;
-    }
-    return -1;
+    // The chains are in descending order, and we want the first match
+    int ret = -1;
+    int i = first_var_with_name(name, namelength);
+    if (i != -1 && !string_equals(vars[i].name, vars[i].length, name, namelength))
+        i = next_var_with_name(i, name, namelength);
+    for (; i != -1; i = next_var_with_name(i, name, namelength))
+        if (vars[i].level == -1)
+            ret = i;
+    return ret;
 }
 
 vartype *recall_global_var(const char *name, int namelength) {
@@ -613,15 +820,122 @@ vartype *recall_global_var(const char *name, int namelength) {
         return vars[varindex].value;
 }
 
-equation_data *find_equation_data(const char *name, int namelength) {
-    for (int i = prgms_count; i < prgms_and_eqns_count; i++) {
-        equation_data *eqd = prgms[i].eq_data;
-        if (eqd != NULL && eqd->ev != NULL) {
-            std::string s = eqd->ev->eqnName();
-            if (s.length() > 0 && string_equals(s.c_str(), (int) s.length(), name, namelength))
-                return eqd;
+/* The equation index maps equation names to equation indexes, for
+ * find_equation_data(), which is what GETEQN uses to find the equation
+ * called by name from another equation. Each bucket is a chain of equation
+ * indexes, linked through eqn_index_next, in ascending order, so the first
+ * match is the same one a forward scan of the equations would find.
+ * Equations never change once they have been created, so the names can only
+ * change when equations are created or deleted; every place that does either
+ * bumps eqn_generation, and the index is rebuilt on the next lookup after
+ * that. If there isn't enough memory for the index, lookups scan the
+ * equations instead.
+ */
+uint4 eqn_generation = 0;
+static uint4 eqn_index_generation = 0;
+static bool eqn_index_valid = false;
+static int eqn_index_size = 0;
+static int *eqn_index_buckets = NULL;
+static int eqn_index_capacity = 0;
+static int *eqn_index_next = NULL;
+static std::vector<std::string> eqn_index_names;
+
+static std::string equation_name(equation_data *eqd) {
+    // Equations created by isolate() have no text, and no name
+    if (eqd == NULL || eqd->text == NULL)
+        return std::string();
+    else if (eqd->ev != NULL)
+        return eqd->ev->eqnName();
+    else
+        // Not parsed yet; no need to parse the whole thing just for this
+        return Parser::parseName(std::string(eqd->text, eqd->length), eqd->compatMode);
+}
+
+static void drop_eqn_index() {
+    free(eqn_index_buckets);
+    eqn_index_buckets = NULL;
+    eqn_index_size = 0;
+    free(eqn_index_next);
+    eqn_index_next = NULL;
+    eqn_index_capacity = 0;
+    eqn_index_names.clear();
+    eqn_index_valid = false;
+}
+
+/* Brings the index up to date; returns false if there isn't enough memory
+ * for it.
+ */
+static bool update_eqn_index() {
+    if (eqn_index_valid && eqn_index_generation == eqn_generation)
+        return true;
+    int n = prgms_and_eqns_count - prgms_count;
+    if (n > eqn_index_capacity) {
+        int *new_next = (int *) realloc(eqn_index_next, n * sizeof(int));
+        if (new_next == NULL) {
+            drop_eqn_index();
+            return false;
         }
+        eqn_index_next = new_next;
+        eqn_index_capacity = n;
     }
+    int size = 16;
+    while (size < n * 2)
+        size <<= 1;
+    if (size != eqn_index_size) {
+        free(eqn_index_buckets);
+        eqn_index_buckets = (int *) malloc(size * sizeof(int));
+        if (eqn_index_buckets == NULL) {
+            drop_eqn_index();
+            return false;
+        }
+        eqn_index_size = size;
+    }
+    for (int i = 0; i < size; i++)
+        eqn_index_buckets[i] = -1;
+    eqn_index_names.resize(n);
+    for (int i = n - 1; i >= 0; i--) {
+        std::string &s = eqn_index_names[i];
+        s = equation_name(prgms[i + prgms_count].eq_data);
+        if (s.length() == 0)
+            continue;
+        int h = string_hash(s.c_str(), (int) s.length()) & (size - 1);
+        eqn_index_next[i] = eqn_index_buckets[h];
+        eqn_index_buckets[h] = i;
+    }
+    eqn_index_generation = eqn_generation;
+    eqn_index_valid = true;
+    return true;
+}
+
+static bool only_in_equation_cache(equation_data *eqd) {
+    if (eqd->refcount != 1)
+        return false;
+    for (int i = 0; i < eqn_cache_count; i++)
+        if (prgms[((vartype_equation *) eqn_cache[i])->data.index()].eq_data == eqd)
+            return true;
+    return false;
+}
+
+static bool equation_matches(int i, const std::string &s, const char *name, int namelength) {
+    if (s.length() == 0 || !string_equals(s.c_str(), (int) s.length(), name, namelength))
+        return false;
+    // Equations that are only being kept alive by the parse cache
+    // would have been deleted without it, so they don't count
+    return !only_in_equation_cache(prgms[i + prgms_count].eq_data);
+}
+
+equation_data *find_equation_data(const char *name, int namelength) {
+    if (!update_eqn_index()) {
+        int n = prgms_and_eqns_count - prgms_count;
+        for (int i = 0; i < n; i++)
+            if (equation_matches(i, equation_name(prgms[i + prgms_count].eq_data), name, namelength))
+                return prgms[i + prgms_count].eq_data;
+        return NULL;
+    }
+    int i = eqn_index_buckets[string_hash(name, namelength) & (eqn_index_size - 1)];
+    for (; i != -1; i = eqn_index_next[i])
+        if (equation_matches(i, eqn_index_names[i], name, namelength))
+            return prgms[i + prgms_count].eq_data;
     return NULL;
 }
 
@@ -674,7 +988,7 @@ int store_params() {
     } else { // TYPE_EQUATION
         vartype_equation *eq = (vartype_equation *) stack[sp];
         equation_data *eqd = prgms[eq->data.index()].eq_data;
-        std::vector<std::string> *params = eqd->ev->eqnParamNames();
+        std::vector<std::string> *params = eqd->get_ev()->eqnParamNames();
         return store_params2(params);
     }
 }
@@ -709,16 +1023,23 @@ int store_var(const char *name, int namelength, vartype *value, bool local, bool
              * already exist, and insert the new global *before* the lowest-level
              * matching local...
              */
-            for (int i = 0; i < vars_count; i++)
-                if (string_equals(name, namelength, vars[i].name, vars[i].length)) {
-                    memmove(vars + i + 1, vars + i, (vars_count - i) * sizeof(var_struct));
-                    varindex = i;
-                    vars_count++;
-                    vars[i + 1].flags |= VAR_HIDING;
-                    vars[i].flags = VAR_HIDDEN;
-                    vars[i].level = -1;
-                    goto done;
-                }
+            int i = first_var_with_name(name, namelength);
+            int lowest = -1;
+            if (i != -1 && !string_equals(vars[i].name, vars[i].length, name, namelength))
+                i = next_var_with_name(i, name, namelength);
+            for (; i != -1; i = next_var_with_name(i, name, namelength))
+                lowest = i;
+            i = lowest;
+            if (i != -1) {
+                memmove(vars + i + 1, vars + i, (vars_count - i) * sizeof(var_struct));
+                varindex = i;
+                vars_count++;
+                vars[i + 1].flags |= VAR_HIDING;
+                vars[i].flags = VAR_HIDDEN;
+                vars[i].level = -1;
+                invalidate_var_index();
+                goto done;
+            }
         }
         varindex = vars_count++;
         vars[varindex].length = namelength;
@@ -776,16 +1097,17 @@ void purge_var(const char *name, int namelength) {
         matedit_mode = 0;
     free_vartype(vars[varindex].value);
     if ((vars[varindex].flags & VAR_HIDING) != 0) {
-        for (int i = varindex - 1; i >= 0; i--)
-            if ((vars[i].flags & VAR_HIDDEN) != 0 && string_equals(vars[i].name, vars[i].length, name, namelength)) {
-                vars[i].flags &= ~VAR_HIDDEN;
-                break;
-            }
+        int i = find_hidden_var(varindex);
+        if (i != -1)
+            vars[i].flags &= ~VAR_HIDDEN;
         pop_indexed_matrix(name, namelength);
     }
+    if (varindex < vars_count - 1)
+        invalidate_var_index();
     for (int i = varindex; i < vars_count - 1; i++)
         vars[i] = vars[i + 1];
     vars_count--;
+    truncate_var_index();
     update_catalog();
 }
 
@@ -825,11 +1147,15 @@ bool vars_exist(int section) {
 }
 
 bool contains_strings(const vartype_realmatrix *rm) {
+    if (rm->array->string_count == 0)
+        return false;
     int4 size = rm->rows * rm->columns;
+    int4 n = 0;
     for (int4 i = 0; i < size; i++)
         if (rm->array->is_string[i] != 0)
-            return true;
-    return false;
+            n++;
+    rm->array->string_count = n;
+    return n != 0;
 }
 
 /* This is only used by core_linalg1, and does not deal with strings,
@@ -848,6 +1174,7 @@ int matrix_copy(vartype *dst, const vartype *src) {
             int4 size = s->rows * s->columns;
             free_long_strings(d->array->is_string, d->array->data, size);
             memset(d->array->is_string, 0, size);
+            d->array->string_count = 0;
             memcpy(d->array->data, s->array->data, size * sizeof(phloat));
             return ERR_NONE;
         } else if (dst->type == TYPE_COMPLEXMATRIX) {
@@ -912,9 +1239,12 @@ vartype *recall_and_purge_private_var(const char *name, int namelength) {
     if (varindex == -1)
         return NULL;
     vartype *ret = vars[varindex].value;
+    if (varindex < vars_count - 1)
+        invalidate_var_index();
     for (int i = varindex; i < vars_count - 1; i++)
         vars[i] = vars[i + 1];
     vars_count--;
+    truncate_var_index();
     return ret;
 }
 
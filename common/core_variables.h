@@ -31,14 +31,20 @@ class CodeMap;
 class equation_data {
     public:
     int refcount;
-    equation_data() : refcount(0), length(0), text(NULL), ev(NULL), map(NULL) {}
+    equation_data() : refcount(0), length(0), text(NULL), ev(NULL), map(NULL), direct(-1) {}
     ~equation_data();
     int4 length;
     char *text;
+    // The parse tree. Equations loaded from the state file are not parsed
+    // until they are needed, so use get_ev() rather than reading this
+    // directly.
     Evaluator *ev;
+    Evaluator *get_ev();
     CodeMap *map;
     bool compatMode;
     int eqn_index;
+    // Whether ev can be evaluated directly: 0 = no, 1 = yes, -1 = not known yet
+    signed char direct;
 };
 
 class pgm_index {
@@ -164,6 +170,11 @@ struct realmatrix_data {
     int refcount;
     phloat *data;
     char *is_string;
+    /* The number of elements that are strings, or more, if some have been
+     * overwritten with numbers since it was last counted; 0 means there are
+     * none, and contains_strings() doesn't have to look.
+     */
+    int4 string_count;
 };
 
 struct vartype_realmatrix {
@@ -235,6 +246,7 @@ vartype *new_realmatrix(int4 rows, int4 columns);
 vartype *new_complexmatrix(int4 rows, int4 columns);
 vartype *new_list(int4 size);
 vartype *new_equation(const char *text, int4 length, bool compat_mode, int *errpos, int eqn_index = -1);
+void flush_equation_cache();
 void free_vartype(vartype *v);
 void clean_vartype_pools();
 void free_long_strings(char *is_string, phloat *data, int4 n);
@@ -243,9 +255,14 @@ void get_matrix_string(const vartype_realmatrix *rm, int4 i, const char **text,
 bool put_matrix_string(vartype_realmatrix *rm, int4 i, const char *text, int4 length);
 vartype *dup_vartype(const vartype *v);
 int disentangle(vartype *v);
+void invalidate_var_index();
+void truncate_var_index();
 int lookup_var(const char *name, int namelength);
+int find_hidden_var(int varindex);
 vartype *recall_var(const char *name, int namelength);
 vartype *recall_global_var(const char *name, int namelength);
+/* Incremented whenever an equation is created or deleted */
+extern uint4 eqn_generation;
 equation_data *find_equation_data(const char *name, int namelength);
 int store_params();
 bool ensure_var_space(int n);
@@ -0,0 +1,425 @@
+///////////////////////////////////////////////////////////////////////////////
+// Plus42 -- an enhanced HP-42S calculator simulator
+// Copyright (C) 2004-2021  Thomas Okken
+//
+// This program is free software; you can redistribute it and/or modify
+// it under the terms of the GNU General Public License, version 2,
+// as published by the Free Software Foundation.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program; if not, see http://www.gnu.org/licenses/.
+///////////////////////////////////////////////////////////////////////////////
+
+/* Headless shell: runs programs from the command line, without a display or
+ * keyboard, and reports the results and how long they took. Used for running
+ * calculator workloads unattended, and for benchmarking the core.
+ *
+ * Usage: plus42cli [options] [label...]
+ *
+ *   -s file     load core state from file (a .p42 state file, as found in
+ *               the States directory); without -s, starts from Memory Clear
+ *   -p file     import programs from file; files ending in .raw are read
+ *               with core_import_programs(), anything else is pasted as a
+ *               program listing
+ *   -n count    run each label count times, and report the total time
+ *   -a          print the entire stack, not just X
+ *   -v          show printer output (PRX, PRA, etc.) on standard output
+ *   -P file     profile the programs while they run, and write the report
+ *               to file; with -P -, print a summary as printer output
+ *   -b size     use the given block size for matrix multiplication; 0 turns
+ *               blocking off
+ *   -B          find the best block size for matrix multiplication on this
+ *               machine, report it on standard error, and use it
+ *   -t threads  use at most this many threads for large matrix operations;
+ *               1 turns multithreading off
+ *
+ * The labels are run one after the other, each starting with the stack the
+ * previous one left behind. For each label, one line is written to standard
+ * output:
+ *
+ *   LABEL<tab>runs<tab>seconds<tab>X
+ *
+ * followed, with -a, by one line per stack level. Messages from the core go
+ * to standard error. The exit status is 1 if a label could not be found.
+ */
+
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/time.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "shell.h"
+#include "shell_spool.h"
+#include "core_main.h"
+
+#define KEY_SHIFT 28
+#define KEY_EXIT 33
+#define KEY_RUN 36
+
+static bool print_to_stdout = false;
+static bool timeout3_pending = false;
+static bool quit_flag = false;
+static volatile sig_atomic_t interrupted = 0;
+
+
+static void usage() {
+    fprintf(stderr, "Usage: plus42cli [-s statefile] [-p programfile]... [-n count] [-a] [-v] [-P profilefile] [-b blocksize] [-B] [-t threads] label...\n");
+    exit(2);
+}
+
+static void int_handler(int sig) {
+    interrupted = 1;
+}
+
+static double now() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static void press_key(int key) {
+    bool enqueued;
+    int repeat;
+    core_keydown(key, &enqueued, &repeat);
+    core_keyup();
+}
+
+/* Keeps the core running until the program stops, or until the user presses
+ * Ctrl-C, in which case the program is stopped the way the EXIT key would.
+ */
+static void run_until_stopped(bool running) {
+    while (true) {
+        while (running && !interrupted && !quit_flag) {
+            bool enqueued;
+            int repeat;
+            running = core_keydown(0, &enqueued, &repeat);
+        }
+        if (interrupted || quit_flag)
+            break;
+        if (!timeout3_pending)
+            break;
+        // PSE: no display to look at, so no need to wait
+        timeout3_pending = false;
+        running = core_timeout3(false);
+    }
+    if (interrupted)
+        press_key(KEY_EXIT);
+}
+
+static bool import_file(const char *filename) {
+    if (access(filename, R_OK) != 0) {
+        perror(filename);
+        return false;
+    }
+    size_t len = strlen(filename);
+    if (len > 4 && strcasecmp(filename + len - 4, ".raw") == 0) {
+        core_import_programs(0, filename);
+        return true;
+    }
+    FILE *f = fopen(filename, "r");
+    if (f == NULL) {
+        perror(filename);
+        return false;
+    }
+    char *buf = NULL;
+    size_t size = 0;
+    size_t capacity = 0;
+    while (true) {
+        if (size + 4096 + 1 > capacity) {
+            capacity += 65536;
+            buf = (char *) realloc(buf, capacity);
+            if (buf == NULL) {
+                fclose(f);
+                fprintf(stderr, "%s: out of memory\n", filename);
+                return false;
+            }
+        }
+        size_t n = fread(buf + size, 1, 4096, f);
+        if (n == 0)
+            break;
+        size += n;
+    }
+    fclose(f);
+    buf[size] = 0;
+    // core_paste() treats the text as a program listing in program mode
+    press_key(KEY_SHIFT);
+    press_key(KEY_RUN);
+    core_paste(buf);
+    press_key(KEY_EXIT);
+    free(buf);
+    return true;
+}
+
+int main(int argc, char *argv[]) {
+    const char *state_file = NULL;
+    const char *profile_file = NULL;
+    const char **program_files = (const char **) malloc(argc * sizeof(char *));
+    int program_files_count = 0;
+    int count = 1;
+    bool whole_stack = false;
+    int block_size = -1;
+    bool tune = false;
+    int threads = -1;
+    int c;
+
+    while ((c = getopt(argc, argv, "s:p:n:avP:b:Bt:")) != -1) {
+        switch (c) {
+            case 's':
+                state_file = optarg;
+                break;
+            case 'p':
+                program_files[program_files_count++] = optarg;
+                break;
+            case 'n':
+                count = atoi(optarg);
+                if (count < 1)
+                    usage();
+                break;
+            case 'a':
+                whole_stack = true;
+                break;
+            case 'v':
+                print_to_stdout = true;
+                break;
+            case 'P':
+                profile_file = optarg;
+                if (strcmp(profile_file, "-") == 0)
+                    print_to_stdout = true;
+                break;
+            case 'b':
+                block_size = atoi(optarg);
+                if (block_size < 0)
+                    usage();
+                break;
+            case 'B':
+                tune = true;
+                break;
+            case 't':
+                threads = atoi(optarg);
+                if (threads < 1)
+                    usage();
+                break;
+            default:
+                usage();
+        }
+    }
+    if (optind == argc && !tune)
+        usage();
+
+    /* core_init() renames state files it can't read; we don't want to
+     * mess with the user's files, so we load from a copy.
+     */
+    char tmpname[] = "/tmp/plus42cli.XXXXXX";
+    bool have_state = false;
+    if (state_file != NULL) {
+        FILE *in = fopen(state_file, "rb");
+        if (in == NULL) {
+            perror(state_file);
+            return 2;
+        }
+        int fd = mkstemp(tmpname);
+        FILE *out = fd == -1 ? NULL : fdopen(fd, "wb");
+        if (out == NULL) {
+            perror(tmpname);
+            return 2;
+        }
+        char buf[8192];
+        size_t n;
+        while ((n = fread(buf, 1, sizeof(buf), in)) > 0)
+            fwrite(buf, 1, n, out);
+        fclose(in);
+        fclose(out);
+        have_state = true;
+    }
+    core_init(have_state ? 1 : 0, 26, have_state ? tmpname : NULL, 0);
+    if (have_state)
+        unlink(tmpname);
+
+    if (block_size != -1)
+        core_settings.matrix_block_size = block_size;
+    if (threads != -1)
+        core_settings.matrix_threads = threads;
+    if (tune)
+        fprintf(stderr, "Matrix block size: %d\n", core_tune_matrix_block_size());
+
+    // Get out of program mode, alpha mode, menus, etc.
+    for (int i = 0; i < 5; i++)
+        press_key(KEY_EXIT);
+
+    for (int i = 0; i < program_files_count; i++)
+        if (!import_file(program_files[i]))
+            return 2;
+    free(program_files);
+
+    signal(SIGINT, int_handler);
+    if (profile_file != NULL)
+        core_profile(true);
+
+    int status = 0;
+    for (int i = optind; i < argc && !interrupted && !quit_flag; i++) {
+        const char *label = argv[i];
+        bool found = true;
+        double start = now();
+        int runs;
+        for (runs = 0; runs < count && found && !interrupted && !quit_flag; runs++)
+            run_until_stopped(core_run_label(label, &found));
+        double elapsed = now() - start;
+        if (!found) {
+            fprintf(stderr, "%s: label not found\n", label);
+            status = 1;
+            continue;
+        }
+        char *x = core_copy();
+        printf("%s\t%d\t%.6f\t%s\n", label, runs, elapsed, x == NULL ? "" : x);
+        free(x);
+        if (whole_stack) {
+            char *s = core_copy_stack();
+            if (s != NULL)
+                fputs(s, stdout);
+            free(s);
+        }
+        fflush(stdout);
+    }
+
+    if (profile_file != NULL) {
+        core_profile(false);
+        core_profile_report(strcmp(profile_file, "-") == 0 ? NULL : profile_file);
+    }
+
+    core_cleanup();
+    return interrupted ? 130 : status;
+}
+
+
+/****************************************************/
+/* Callbacks used by the emulator core (see shell.h) */
+/****************************************************/
+
+const char *shell_platform() {
+    return VERSION " " VERSION_PLATFORM " CLI";
+}
+
+void shell_blitter(const char *bits, int bytesperline, int x, int y,
+                                     int width, int height) {
+    // No display
+}
+
+void shell_beeper(int frequency, int duration) {
+    // No sound
+}
+
+void shell_annunciators(int updn, int shf, int prt, int run, int g, int rad) {
+    // No display
+}
+
+bool shell_wants_cpu() {
+    return interrupted != 0;
+}
+
+void shell_delay(int duration) {
+    // No display to look at, so no need to wait
+}
+
+void shell_request_timeout3(int delay) {
+    timeout3_pending = true;
+}
+
+uint4 shell_get_mem() {
+    FILE *meminfo = fopen("/proc/meminfo", "r");
+    char line[1024];
+    uint8 bytes = 0;
+    if (meminfo == NULL)
+        return 0;
+    while (fgets(line, 1024, meminfo) != NULL) {
+        if (strncmp(line, "MemFree:", 8) == 0) {
+            uint8 kbytes;
+            if (sscanf(line + 8, "%llu", &kbytes) == 1)
+                bytes = 1024 * kbytes;
+            if (bytes > 4294967295)
+                bytes = 4294967295;
+            break;
+        }
+    }
+    fclose(meminfo);
+    return (uint4) bytes;
+}
+
+bool shell_low_battery() {
+    return false;
+}
+
+void shell_powerdown() {
+    quit_flag = true;
+}
+
+int8 shell_random_seed() {
+    struct timeval tv;
+    gettimeofday(&tv, NULL);
+    return tv.tv_sec * 1000LL + tv.tv_usec / 1000;
+}
+
+uint4 shell_milliseconds() {
+    struct timeval tv;
+    gettimeofday(&tv, NULL);
+    return (uint4) (tv.tv_sec * 1000L + tv.tv_usec / 1000);
+}
+
+bool shell_decimal_point() {
+    return true;
+}
+
+int shell_date_format() {
+    return 0;
+}
+
+bool shell_clk24() {
+    return true;
+}
+
+static void stdout_writer(const char *text, int length) {
+    fwrite(text, 1, length, stdout);
+}
+
+static void stdout_newliner() {
+    fputc('\n', stdout);
+}
+
+void shell_print(const char *text, int length,
+                 const char *bits, int bytesperline,
+                 int x, int y, int width, int height) {
+    if (!print_to_stdout)
+        return;
+    if (text != NULL)
+        shell_spool_txt(text, length, stdout_writer, stdout_newliner);
+    else
+        shell_spool_bitmap_to_txt(bits, bytesperline, x, y, width, height, stdout_writer, stdout_newliner);
+}
+
+void shell_get_time_date(uint4 *time, uint4 *date, int *weekday) {
+    struct timeval tv;
+    gettimeofday(&tv, NULL);
+    struct tm tms;
+    localtime_r(&tv.tv_sec, &tms);
+    if (time != NULL)
+        *time = ((tms.tm_hour * 100 + tms.tm_min) * 100 + tms.tm_sec) * 100 + tv.tv_usec / 10000;
+    if (date != NULL)
+        *date = ((tms.tm_year + 1900) * 100 + tms.tm_mon + 1) * 100 + tms.tm_mday;
+    if (weekday != NULL)
+        *weekday = tms.tm_wday;
+}
+
+void shell_message(const char *message) {
+    fprintf(stderr, "%s\n", message);
+}
+
+void shell_log(const char *message) {
+    fprintf(stderr, "%s\n", message);
+}